@@ -0,0 +1,1546 @@
+#include "ams_merge.h"
+#include "ams_mergecore_hdk.h"
+#include <GU/GU_PackedGeometry.h>
+#include <GU/GU_PrimPacked.h>
+#include <GEO/GEO_PrimPoly.h>
+#include <GA/GA_AIFSharedStringTuple.h>
+#include <GA/GA_AIFTuple.h>
+#include <GA/GA_EdgeGroup.h>
+#include <GA/GA_ElementGroup.h>
+#include <GA/GA_Handle.h>
+#include <GA/GA_Iterator.h>
+#include <GA/GA_PageHandle.h>
+#include <GA/GA_PageIterator.h>
+#include <GA/GA_PolyCounts.h>
+#include <GA/GA_PrimitiveTypes.h>
+#include <GA/GA_SplittableRange.h>
+#include <OP/OP_Context.h>
+#include <OP/OP_Director.h>
+#include <OP/OP_Network.h>
+#include <SOP/SOP_Node.h>
+#include <SYS/SYS_Math.h>
+#include <SYS/SYS_SequentialThreadIndex.h>
+#include <UT/UT_ParallelUtil.h>
+#include <UT/UT_Performance.h>
+#include <UT/UT_StringMap.h>
+#include <UT/UT_WorkArgs.h>
+#include <UT/UT_WorkBuffer.h>
+#include <VOP/VOP_Node.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ams {
+
+const OP_Node* hierarchyParent(const OP_Node& node, bool resolve_subnets) {
+  if (node.getInput(0))
+    return node.getInput(0);
+  if (resolve_subnets) {
+    auto* subnParent = node.getParent();
+    if (subnParent && subnParent->getOpType() == node.getOpType())
+      return subnParent;
+  }
+  return nullptr;
+}
+
+
+GA_Attribute* primStringAttribute(GU_Detail& geo, const char* name) {
+  GA_Attribute* attr = geo.findPrimitiveAttribute(name);
+  if (!attr)
+    attr = geo.addStringTuple(GA_ATTRIB_PRIMITIVE, name, 1);
+  return attr;
+}
+
+
+void fillStringAttribute(GA_Attribute* attr, const GA_Range& range, const char* value) {
+  const GA_AIFSharedStringTuple* aif = attr ? attr->getAIFSharedStringTuple() : nullptr;
+  if (!aif || range.isEmpty())
+    return;
+  GA_AIFSharedStringTuple::StringBuffer buffer(attr, aif);
+  GA_StringIndexType handle = buffer.append(value);
+  // Setting handles updates the reference counts of the shared string table, which isn't safe to do
+  // from several threads, so the range is written by one call.
+  aif->setHandle(attr, range, handle, 0);
+  attr->bumpDataId();
+}
+
+
+void rewriteStrings(GA_Attribute* attr, const CompiledReplace& program) {
+  const GA_AIFSharedStringTuple* aif = attr->getAIFSharedStringTuple();
+  if (!aif)
+    return;
+  UT_Array<GA_StringIndexType> handles;
+  std::vector<std::string> values;
+  for (auto it = aif->begin(attr); !it.atEnd(); ++it) {
+    handles.append(it.getIndex());
+    values.emplace_back(it.getString());
+  }
+  std::vector<std::string> rewritten(values.size());
+  UTparallelFor(UT_BlockedRange<exint>(0, (exint) values.size()), [&](const UT_BlockedRange<exint>& range) {
+    for (exint i = range.begin(); i != range.end(); ++i) {
+      rewritten[i] = program(values[i]);
+    }
+  });
+
+  // Values which end up equal must share a handle, so the table stays free of duplicates.
+  // Only those are remapped element by element.
+  std::map<std::string, GA_StringIndexType> owners;
+  UT_Array<GA_StringIndexType> remap;
+  for (exint i = 0; i < handles.size(); i++) {
+    auto owner = owners.emplace(rewritten[i], handles(i));
+    if (!owner.second) {
+      if (remap.size() <= handles(i)) {
+        exint oldsize = remap.size();
+        remap.setSizeNoInit(handles(i) + 1);
+        for (exint j = oldsize; j < remap.size(); j++)
+          remap(j) = GA_StringIndexType(j);
+      }
+      remap(handles(i)) = owner.first->second;
+    }
+  }
+  for (exint i = 0; i < handles.size(); i++) {
+    if (rewritten[i] != values[i] && owners[rewritten[i]] == handles(i))
+      aif->replaceString(attr, handles(i), rewritten[i].c_str());
+  }
+  // Setting handles updates the reference counts of the string table, so the remap runs on one thread.
+  if (remap.size() > 0) {
+    GA_Offset start, end;
+    for (GA_Iterator it(GA_Range(attr->getIndexMap())); it.blockAdvance(start, end);) {
+      for (GA_Offset offset = start; offset < end; ++offset) {
+        GA_StringIndexType handle = aif->getHandle(attr, offset, 0);
+        if (handle >= 0 && handle < remap.size() && remap(handle) != handle)
+          aif->setHandle(attr, offset, remap(handle), 0);
+      }
+    }
+  }
+  attr->bumpDataId();
+}
+
+
+void rewriteStringAttributes(GU_Detail& geo, const char* attribs, const CompiledReplace& program) {
+  // Collect the targets first, as rewriting must not disturb the attribute dictionaries being traversed.
+  std::vector<GA_Attribute*> targets;
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL}) {
+    for (auto it = geo.getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+      GA_Attribute* attr = it.attrib();
+      if (attr->getAIFSharedStringTuple() && UT_String(attr->getName().c_str()).multiMatch(attribs))
+        targets.push_back(attr);
+    }
+  }
+  for (auto* attr : targets) {
+    rewriteStrings(attr, program);
+  }
+}
+
+
+PhaseTimer::PhaseTimer(const char* event, const char* object, fpreal& total)
+  : myTotal(&total), myEventId(UTgetPerformance()->startEvent(event, object)) {
+  myTimer.start();
+}
+
+
+void PhaseTimer::stop() {
+  if (!myTotal)
+    return;
+  *myTotal += myTimer.lap() * 1000.0;
+  if (myEventId != UT_PERFMON_INVALID_ID)
+    UTgetPerformance()->stopEvent(myEventId);
+  myTotal = nullptr;
+}
+
+
+bool HierarchyPaths::dropIfDirty() {
+  if (!myWatcher.isDirty())
+    return false;
+  myPaths.clear();
+  myWatcher.reset();
+  return true;
+}
+
+
+bool HierarchyPaths::refresh() {
+  std::lock_guard<std::recursive_mutex> lock(myLock);
+  return dropIfDirty();
+}
+
+
+UT_StringHolder HierarchyPaths::path(const OP_Node& node, bool resolve_subnets) {
+  std::lock_guard<std::recursive_mutex> lock(myLock);
+  dropIfDirty();
+  auto key = [resolve_subnets](const OP_Node* n) { return exint(n->getUniqueId()) * 2 + resolve_subnets; };
+
+  // Walk up to the first node whose path is already known, or to the top of the hierarchy.
+  std::vector<const OP_Node*> chain;
+  std::string path;
+  for (const OP_Node* n = &node; n; n = hierarchyParent(*n, resolve_subnets)) {
+    auto found = myPaths.find(key(n));
+    if (found != myPaths.end()) {
+      path = found->second;
+      break;
+    }
+    chain.push_back(n);
+  }
+  // Then build the path back down by appending names, remembering the path of every node on the way,
+  // so that siblings reuse the path of their parent.
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    path += '/';
+    path += (*it)->getName().toStdString();
+    myPaths.emplace(key(*it), path);
+    myWatcher.watch(const_cast<OP_Node*>(*it));
+  }
+  return UT_StringHolder(path);
+}
+
+
+// Whether node is a material a material path can point to: a material VOP or builder, or a SHOP.
+static bool isMaterialNode(OP_Node* node) {
+  if (node->getOpTypeID() == SHOP_OPTYPE_ID)
+    return true;
+  VOP_Node* vop = CAST_VOPNODE(node);
+  return vop && (vop->isMaterial() || vop->getOperator()->getName() == "materialbuilder");
+}
+
+
+// Indexes the materials below net by their path relative to the matnet, and by name.
+// The contents of a material are its shading network, not materials, so they are not scanned.
+static void scanMaterials(OP_Network* net, const std::string& prefix, NodeWatcher& watcher,
+                          std::unordered_map<std::string, OP_Node*>& relpaths,
+                          std::unordered_map<std::string, OP_Node*>& names) {
+  // A network without materials must still report the materials created in it later.
+  watcher.watch(net);
+  for (int i = 0; i < net->getNchildren(); i++) {
+    OP_Node* child = net->getChild(i);
+    std::string relpath = prefix + child->getName().toStdString();
+    if (isMaterialNode(child)) {
+      relpaths.emplace(relpath, child);
+      auto named = names.emplace(child->getName().toStdString(), child);
+      if (!named.second)
+        named.first->second = nullptr; // ambiguous
+      watcher.watch(child);
+    }
+    else if (child->isNetwork())
+      scanMaterials(static_cast<OP_Network*>(child), relpath + "/", watcher, relpaths, names);
+  }
+}
+
+
+bool MaterialLibrary::dropIfDirty() {
+  if (!myWatcher.isDirty())
+    return false;
+  myLookups.clear();
+  myHintPaths.clear();
+  myIndices.clear();
+  myWatcher.reset();
+  return true;
+}
+
+
+bool MaterialLibrary::refresh() {
+  std::lock_guard<std::recursive_mutex> lock(myLock);
+  return dropIfDirty();
+}
+
+
+UT_StringHolder MaterialLibrary::resolveHintPath(OP_Node* relativeto, const UT_StringHolder& hintpath) {
+  if (!hintpath.isstring())
+    return UT_StringHolder();
+  std::lock_guard<std::recursive_mutex> lock(myLock);
+  dropIfDirty();
+  // Relative hint paths are resolved from their node, so they are cached per node.
+  std::string key = hintpath.toStdString();
+  if (relativeto && key[0] != '/')
+    key = relativeto->getFullPath().toStdString() + '\n' + key;
+  auto found = myHintPaths.find(key);
+  if (found == myHintPaths.end()) {
+    std::string resolved = hintpath.toStdString();
+    OP_Node* matnet = relativeto ? relativeto->findNode(hintpath.c_str())
+                                 : OPgetDirector()->findNode(hintpath.c_str());
+    if (matnet) {
+      resolved = matnet->getFullPath().toStdString();
+      myWatcher.watch(matnet);
+    } else {
+      myWatcher.watchMissing(hintpath.c_str());
+    }
+    if (resolved.back() != '/')
+      resolved += '/';
+    found = myHintPaths.emplace(key, resolved).first;
+  }
+  return UT_StringHolder(found->second);
+}
+
+
+const MaterialLibrary::Index& MaterialLibrary::index(const std::string& hintpath) {
+  auto found = myIndices.find(hintpath);
+  if (found != myIndices.end())
+    return found->second;
+  // The matnet is scanned once, then kept until the watcher reports a change inside it.
+  Index& index = myIndices[hintpath];
+  std::string matnetpath = hintpath.size() > 1 ? hintpath.substr(0, hintpath.size() - 1) : hintpath;
+  OP_Node* matnet = OPgetDirector()->findNode(matnetpath.c_str());
+  if (matnet && matnet->isNetwork())
+    scanMaterials(static_cast<OP_Network*>(matnet), "", myWatcher, index.relpaths, index.names);
+  return index;
+}
+
+
+OP_Node* MaterialLibrary::findIndexed(const UT_String& path, const std::string& hintpath, bool matchnames) {
+  if (hintpath.empty())
+    return nullptr;
+  const Index& matnet = index(hintpath);
+  auto found = matnet.relpaths.find(path.toStdString());
+  if (found != matnet.relpaths.end())
+    return found->second;
+  // Nodes inside a material are not indexed. They are still found by their exact path below the matnet.
+  if (!path.isAbsolutePath()) {
+    UT_String fullpath(UT_String::ALWAYS_DEEP, hintpath.c_str());
+    fullpath += path;
+    if (VOP_Node* vop = OPgetDirector()->findVOPNode(fullpath))
+      return vop;
+    myWatcher.watchMissing(fullpath);
+  }
+  if (!matchnames)
+    return nullptr;
+  auto named = matnet.names.find(UT_String(path.fileName()).toStdString());
+  return named != matnet.names.end() ? named->second : nullptr;
+}
+
+
+UT_StringHolder MaterialLibrary::lookup(const char* matpath, const UT_StringHolder& hintpath, bool matchnames,
+                                        OP_Network& objptr, const UT_String& objshoppath) {
+  std::lock_guard<std::recursive_mutex> lock(myLock);
+  dropIfDirty();
+  // The object material is only part of the key when it is used, so geometry material paths
+  // are shared by every source.
+  std::string objkey;
+  if (!UTisstring(matpath) && objshoppath.isstring()) {
+    // Relative object materials are resolved from their object, so they are cached per object.
+    objkey = objshoppath.toStdString();
+    if (!objshoppath.isAbsolutePath())
+      objkey = objptr.getFullPath().toStdString() + "/" + objkey;
+  }
+  Key key(matpath ? matpath : "", hintpath.toStdString(), matchnames, objkey);
+  auto found = myLookups.find(key);
+  if (found != myLookups.end())
+    return found->second; // previously searched. Skip search, even if nothing was found.
+
+  UT_StringHolder& result = myLookups[key];
+  UT_String path(UT_String::ALWAYS_DEEP, matpath);
+  if (!path.isstring() && objshoppath.isstring()) {
+    // uninitialized material path. Use object material path.
+    OP_Node* objmatnode = objptr.findNode(objshoppath);
+    if (objmatnode)
+      path = objmatnode->getFullPath();
+    else
+      path.harden(objshoppath);
+  }
+  if (!path.isstring())
+    return result;
+  OP_Node* matnode = OPgetDirector()->findVOPNode(path);
+  if (!matnode) {
+    myWatcher.watchMissing(path);
+    matnode = findIndexed(path, hintpath.toStdString(), matchnames);
+  }
+  if (matnode) {
+    // matnode has been discovered. Keep it until it, or one of its parents, is renamed or deleted.
+    result = matnode->getFullPath();
+    myWatcher.watch(matnode);
+  }
+  // Otherwise nothing could be found. The missing path, and every network of the matnet, are watched,
+  // so the search runs again once the material may have been created.
+  return result;
+}
+
+
+void resolveMaterials(GU_Detail& gdp, const GA_Range& primrange, OP_Network& objptr, MaterialLibrary& materials,
+                      const UT_StringHolder& hintpath, bool matchnames) {
+  UT_String objshoppath;
+  if (objptr.hasParm("shop_materialpath"))
+    objptr.getParm("shop_materialpath").getValue(0.0f, objshoppath, 0, true, 0);
+
+  // check if material leads to a valid node.
+  // first we will check at the sop level. If resolution fails, check the object material path.
+  GA_Attribute* attr = gdp.findPrimitiveAttribute("shop_materialpath");
+  if (!attr) {
+    // Nothing to resolve but the object material. A new attribute is empty everywhere, so the whole
+    // range takes the same value.
+    UT_StringHolder objmaterial = materials.lookup("", hintpath, matchnames, objptr, objshoppath);
+    if (objmaterial.isstring())
+      fillStringAttribute(primStringAttribute(gdp, "shop_materialpath"), primrange, objmaterial.c_str());
+    return;
+  }
+  const GA_AIFSharedStringTuple* aif = attr->getAIFSharedStringTuple();
+  if (!aif)
+    return;
+
+  // Each handle in the range is resolved once, to the handle of the path it resolves to, by the index
+  // remap of the merge core. Primitives without a material hold no handle at all, and take the object material.
+  GA_AIFSharedStringTuple::StringBuffer buffer(attr, aif);
+  auto remap = core::makeIndexRemap([&](int64_t handle) -> int64_t {
+    const char* matpath = handle < 0 ? "" : aif->getTableString(attr, GA_StringIndexType(handle));
+    UT_StringHolder resolved = materials.lookup(matpath, hintpath, matchnames, objptr, objshoppath);
+    if (!resolved.isstring() || resolved == matpath)
+      return handle;
+    return buffer.append(resolved);
+  });
+
+  // Only primitives whose material changes are written. Setting a handle updates the reference counts
+  // of the string table, so this runs on one thread.
+  bool changed = false;
+  GA_Offset start, end;
+  for (GA_Iterator it(primrange); it.blockAdvance(start, end);) {
+    for (GA_Offset offset = start; offset < end; ++offset) {
+      GA_StringIndexType handle = aif->getHandle(attr, offset, 0);
+      GA_StringIndexType mapped = GA_StringIndexType(remap(handle));
+      if (mapped != handle) {
+        aif->setHandle(attr, offset, mapped, 0);
+        changed = true;
+      }
+    }
+  }
+  if (changed)
+    attr->bumpDataId();
+}
+
+
+bool hasOnlyPointTransforms(const GU_Detail& geo) {
+  GA_Size count = 0;
+  for (int type : {GA_PRIMPOLY, GA_PRIMPOLYSOUP, GA_PRIMTETRAHEDRON, GA_PRIMMESH,
+                   GA_PRIMNURBCURVE, GA_PRIMNURBSURF, GA_PRIMBEZCURVE, GA_PRIMBEZSURF}) {
+    count += geo.countPrimitiveType(GA_PrimitiveTypeId(type));
+  }
+  return count == geo.getNumPrimitives();
+}
+
+
+UT_StringHolder indexAttribName(const char* base) {
+  UT_WorkBuffer name;
+  name.sprintf("%s_index", base);
+  return UT_StringHolder(name);
+}
+
+
+// The name of the detail array the unique paths of an indexed path attribute are written to.
+static UT_StringHolder tableAttribName(const char* base) {
+  UT_WorkBuffer name;
+  name.sprintf("%s_table", base);
+  return UT_StringHolder(name);
+}
+
+
+bool isRewriteTarget(const char* attribname, const std::vector<RewriteRule>& rules) {
+  for (auto& rule : rules) {
+    if (UT_String(attribname).multiMatch(rule.attribs.c_str()))
+      return true;
+  }
+  return false;
+}
+
+
+// Cooks the SOP of every source. creator is the object of the node merging them, whose render state
+// the sources are cooked with.
+static void cookSources(std::vector<MergeSource>& sources, OP_Context& context, bool parallel, OP_Network* creator) {
+  // Peek whether we are a render cook or not.
+  int cookrender = creator ? creator->isCookingRender() : 0;
+  // Change over so any subnet evaluation will properly track...
+  // Several sources may live in the same object, so the state is saved once per object.
+  std::map<OP_Network*, int> savecookrender;
+  for (auto& source : sources) {
+    if (savecookrender.count(source.objptr) == 0) {
+      savecookrender[source.objptr] = source.objptr->isCookingRender();
+      source.objptr->setCookingRender(cookrender);
+    }
+  }
+  // A SOP reached through several objpath# entries is cooked once, by the first source which references it.
+  std::vector<int> cooks;
+  std::vector<int> cookedby(sources.size());
+  std::unordered_map<SOP_Node*, int> firstsources;
+  for (int i = 0; i < (int) sources.size(); i++) {
+    auto found = firstsources.emplace(sources[i].sopptr, i);
+    cookedby[i] = found.first->second;
+    if (found.second)
+      cooks.push_back(i);
+  }
+  // Actually cook...
+  if (parallel && cooks.size() > 1) {
+    // Each source is its own task. Upstream nodes serialize on their own cook locks,
+    // so sources which share inputs are still cooked only once.
+    UTparallelForEachNumber((exint) cooks.size(), [&](const UT_BlockedRange<exint>& range) {
+      for (exint i = range.begin(); i != range.end(); ++i) {
+        MergeSource& source = sources[cooks[i]];
+        OP_Context threadcontext(context);
+        threadcontext.setThread(SYSgetSTID());
+        UT_StopWatch timer;
+        timer.start();
+        source.cookedgdh = source.sopptr->getCookedGeoHandle(threadcontext);
+        source.cooktime = timer.lap() * 1000.0;
+      }
+    }, true);
+  } else {
+    for (int i : cooks) {
+      UT_StopWatch timer;
+      timer.start();
+      sources[i].cookedgdh = sources[i].sopptr->getCookedGeoHandle(context);
+      sources[i].cooktime = timer.lap() * 1000.0;
+    }
+  }
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (cookedby[i] != (int) i)
+      sources[i].cookedgdh = sources[cookedby[i]].cookedgdh;
+  }
+  for (auto& source : sources) {
+    source.cookedgdp = source.cookedgdh.gdp();
+    source.sourcegdh = source.cookedgdh;
+    source.sourcegdp = source.cookedgdp;
+    if (source.cookedgdp)
+      source.cookedid = source.cookedgdp->getUniqueId();
+  }
+  // Restore the cooking render state.
+  for (auto& saved : savecookrender) {
+    saved.first->setCookingRender(saved.second);
+  }
+}
+
+
+// Replaces the geometry of every source with a copy that lacks the attributes and groups of the filter.
+static void filterSources(std::vector<MergeSource>& sources, const SourceFilter& filter) {
+  bool filtering = filter.groups.isstring();
+  for (const UT_String& pattern : filter.attribs)
+    filtering |= pattern.isstring();
+  if (!filtering)
+    return;
+  // Sources which share a cooked detail share its filtered copy as well, so they can still be instanced.
+  std::unordered_map<const GU_Detail*, GU_DetailHandle> filteredcopies;
+  for (auto& source : sources) {
+    if (!source.cookedgdp)
+      continue;
+    auto shared = filteredcopies.find(source.cookedgdp);
+    if (shared != filteredcopies.end()) {
+      source.cookedgdh = shared->second;
+      source.cookedgdp = shared->second.gdp();
+      continue;
+    }
+    const GU_Detail& geo = *source.cookedgdp;
+    std::vector<std::pair<GA_AttributeOwner, UT_StringHolder>> attribs;
+    for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL}) {
+      if (!filter.attribs[owner].isstring())
+        continue;
+      for (auto it = geo.getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+        UT_String name(it.attrib()->getName().c_str());
+        if (owner == GA_ATTRIB_POINT && name == "P")
+          continue;
+        if (name.multiMatch(filter.attribs[owner]))
+          attribs.push_back({owner, it.attrib()->getName()});
+      }
+    }
+    std::vector<std::pair<GA_GroupType, UT_StringHolder>> groups;
+    auto matchGroups = [&](const auto& table, GA_GroupType type) {
+      for (auto it = table.beginTraverse(); !it.atEnd(); ++it) {
+        UT_String name(it.group()->getName().c_str());
+        if (!it.group()->isInternal() && name.multiMatch(filter.groups))
+          groups.push_back({type, it.group()->getName()});
+      }
+    };
+    if (filter.groups.isstring()) {
+      matchGroups(geo.pointGroups(), GA_GROUP_POINT);
+      matchGroups(geo.vertexGroups(), GA_GROUP_VERTEX);
+      matchGroups(geo.primitiveGroups(), GA_GROUP_PRIMITIVE);
+      matchGroups(geo.edgeGroups(), GA_GROUP_EDGE);
+    }
+    if (attribs.empty() && groups.empty())
+      continue;
+    // The filtered copy shares every page with the cooked detail, so neither what is kept nor what
+    // is removed gets copied. Removing an attribute only drops the copy's references to its pages.
+    GU_DetailHandle filtered;
+    filtered.allocateAndSet(new GU_Detail());
+    GU_Detail* filteredgdp = filtered.gdpNC();
+    filteredgdp->replaceWith(geo);
+    for (auto& attrib : attribs)
+      filteredgdp->destroyAttribute(attrib.first, attrib.second);
+    for (auto& group : groups)
+      filteredgdp->getGroupTable(group.first)->destroy(group.second);
+    filteredcopies[source.cookedgdp] = filtered;
+    source.cookedgdh = filtered;
+    source.cookedgdp = filteredgdp;
+  }
+}
+
+
+// The transform of a source object relative to the transform object.
+static UT_Matrix4D sourceTransform(OP_Network& objptr, OP_Network& xformobjptr, OP_Context& context, MergeHost& host) {
+  // GEO_Detail::transform supports double-precision,
+  // so we might as well use double-precision transforms.
+  UT_Matrix4D xform, xform2;
+  if (!objptr.getWorldTransform(xform, context))
+    host.addTransformError(objptr, "world");
+  if (!xformobjptr.getIWorldTransform(xform2, context))
+    host.addTransformError(xformobjptr, "inverse world");
+  xform *= xform2;
+  return xform;
+}
+
+
+std::vector<MergeSource> gatherSources(const ParmSnapshot& snapshot, MergeHost& host, OP_Context& context,
+                                       MergeStats& stats) {
+  const MergeOptions& options = snapshot.options;
+  OP_Node* self = host.node();
+  UT_StringHolder label(self ? self->getFullPath() : UT_StringHolder());
+
+  // Get our xform object, if any.
+  OP_Network* xformobjptr = nullptr;
+  if (self && options.xformpath.isstring()) {
+    OP_Node* xformnode = self->findNode(options.xformpath.c_str());
+    if (xformnode && xformnode->getOpTypeID() == SOP_OPTYPE_ID) {
+      // The user pointed to the SOP.  We silently promote it to the
+      // containing object.  This allows the intuitive "." to be used
+      // for the path to transform relative to our own op (rather than
+      // having to track up an arbitrary number of paths)
+      xformnode = xformnode->getCreator();
+    }
+    // We must explicitly cast down as OBJ_Node * is unknown here.
+    // We also do the cast here instead of in findNode as we want
+    // to allow people to reference SOPs.
+    xformobjptr = (OP_Network*) CAST_OBJNODE(xformnode);
+    if (!xformobjptr) {
+      // We didn't get an xform object, but they had something typed,
+      // badmerge.
+      host.addError(SOP_BAD_SOP_MERGED, options.xformpath.c_str());
+    }
+  }
+
+  // Resolve every enabled objpath# entry up front, so the independent upstream SOPs
+  // can be cooked together before any geometry is merged.
+  PhaseTimer resolvetimer("Resolve Objects", label.c_str(), stats.resolvetime);
+  std::vector<MergeSource> sources;
+  for (const ObjectEntry& entry : snapshot.entries) {
+    if (!entry.enabled)                   // Ignore disabled ones.
+      continue;
+    if (!entry.path.isstring())
+      continue;                           // Blank means ignore.
+    for (OP_Node* node : host.entryNodes(entry)) {
+      // Objects merge their display SOP.
+      SOP_Node* sopptr = CAST_SOPNODE(node);
+      if (!sopptr && node->isNetwork())
+        sopptr = CAST_SOPNODE(((OP_Network*) node)->getDisplayNodePtr());
+      if (self && sopptr == self) {
+        // Self-reference.  Special brand of evil.
+        host.addWarning(SOP_ERR_SELFMERGE);
+        continue;
+      }
+      if (!sopptr) {
+        // Illegal merge.  Just warn so we don't abort everything.
+        host.addWarning(SOP_BAD_SOP_MERGED, node->getFullPath().c_str());
+        continue;
+      }
+      // We want extra inputs. Follow the display flag of objects as well as the SOP itself.
+      if (node != sopptr)
+        host.addDependency(node, OP_INTEREST_FLAG);
+      host.addDependency(sopptr, OP_INTEREST_DATA);
+      // Get the creator, which is our objptr.
+      sources.push_back({entry.objindex, UT_StringHolder(sopptr->getFullPath()), sopptr, sopptr->getCreator(),
+                         GU_ConstDetailHandle(), nullptr, GU_ConstDetailHandle(), nullptr, -1, 0.0,
+                         UT_Matrix4D(1.0), false, UT_StringHolder(), UT_StringHolder()});
+    }
+  }
+  resolvetimer.stop();
+
+  PhaseTimer cooktimer("Cook Objects", label.c_str(), stats.cooktime);
+  cookSources(sources, context, options.cookparallel, self ? self->getCreator() : nullptr);
+  cooktimer.stop();
+  filterSources(sources, options.filter);
+
+  // Every transform and path is known before anything is copied.
+  for (MergeSource& source : sources) {
+    if (!source.cookedgdp)
+      continue;
+    // The sop extra inputs were added while resolving.
+    host.addDependency(source.objptr, OP_INTEREST_DATA);
+    source.nodepath = source.objptr->getFullPath();
+    // Create a path from the hierarchy of transforms. This is not to be confused with a node "directory" path.
+    if (options.enablepathattrib)
+      source.hierpath = host.hierarchyPaths().path(*source.objptr, options.resolvesubnets);
+    if (xformobjptr) {
+      source.xform = sourceTransform(*source.objptr, *xformobjptr, context, host);
+      source.transformed = true;
+    }
+  }
+  if (xformobjptr)
+    host.addDependency(xformobjptr, OP_INTEREST_DATA);
+  return sources;
+}
+
+
+// Where each source lands in the merged detail, and the attributes and groups it needs before anything is copied.
+struct MergePlan {
+  /** @brief the points, vertices and primitives of each source, indexed like the sources. */
+  std::vector<core::SourceRanges> ranges;
+  GA_Size numpoints = 0, numvertices = 0, numprims = 0;
+  /** @brief the union of the point, vertex and primitive attributes of all sources. The first occurrence is the prototype. */
+  std::vector<const GA_Attribute*> attribs;
+  /** @brief the union of the groups of all sources. */
+  std::vector<std::pair<GA_GroupType, UT_StringHolder>> groups;
+};
+
+
+static MergePlan planMerge(const std::vector<MergeSource>& sources) {
+  MergePlan plan;
+  // Sources are laid out one after the other, the same way the merge core plans them.
+  std::vector<ams::core::ElementCounts> counts;
+  for (const MergeSource& source : sources) {
+    const GU_Detail* geo = source.cookedgdp;
+    ams::core::ElementCounts sourcecounts;
+    if (geo) {
+      sourcecounts.points = (size_t) geo->getNumPoints();
+      sourcecounts.vertices = (size_t) geo->getNumVertices();
+      sourcecounts.prims = (size_t) geo->getNumPrimitives();
+    }
+    counts.push_back(sourcecounts);
+  }
+  ams::core::ElementCounts total = ams::core::planRanges(counts, plan.ranges);
+  plan.numpoints = (GA_Size) total.points;
+  plan.numvertices = (GA_Size) total.vertices;
+  plan.numprims = (GA_Size) total.prims;
+
+  std::set<std::pair<int, std::string>> attribs, groups;
+  for (const MergeSource& source : sources) {
+    const GU_Detail* geo = source.cookedgdp;
+    if (!geo)
+      continue;
+    // Detail attributes are left to the copy chain, which also copies their values.
+    for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+      for (auto it = geo->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+        if (attribs.insert({owner, it.attrib()->getName().toStdString()}).second)
+          plan.attribs.push_back(it.attrib());
+      }
+    }
+    auto planGroups = [&](const auto& table, GA_GroupType type) {
+      for (auto it = table.beginTraverse(); !it.atEnd(); ++it) {
+        if (!it.group()->isInternal() && groups.insert({type, it.group()->getName().toStdString()}).second)
+          plan.groups.push_back({type, it.group()->getName()});
+      }
+    };
+    planGroups(geo->pointGroups(), GA_GROUP_POINT);
+    planGroups(geo->vertexGroups(), GA_GROUP_VERTEX);
+    planGroups(geo->primitiveGroups(), GA_GROUP_PRIMITIVE);
+    planGroups(geo->edgeGroups(), GA_GROUP_EDGE);
+  }
+  return plan;
+}
+
+
+static void applyMergeSchema(GU_Detail& gdp, const MergePlan& plan) {
+  // Elements copied before an attribute or group existed get its defaults, so creating
+  // them all at once leaves the same result as adding them source by source.
+  // Whatever gdp already has is kept.
+  for (const GA_Attribute* attr : plan.attribs) {
+    if (!gdp.findAttribute(attr->getOwner(), attr->getName()))
+      gdp.getAttributes().cloneAttribute(attr->getOwner(), attr->getName(), *attr, true);
+  }
+  for (auto& group : plan.groups) {
+    const char* name = group.second.c_str();
+    switch (group.first) {
+      case GA_GROUP_POINT:
+        if (!gdp.findPointGroup(name))
+          gdp.newPointGroup(name);
+        break;
+      case GA_GROUP_VERTEX:
+        if (!gdp.findVertexGroup(name))
+          gdp.newVertexGroup(name);
+        break;
+      case GA_GROUP_PRIMITIVE:
+        if (!gdp.findPrimitiveGroup(name))
+          gdp.newPrimitiveGroup(name);
+        break;
+      case GA_GROUP_EDGE:
+        if (!gdp.findEdgeGroup(name))
+          gdp.newEdgeGroup(name);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+
+// Removes the internal groups of a detail, which the copy chain leaves behind.
+static void destroyInternalGroups(GU_Detail& geo) {
+  UT_Array<GA_ElementGroup*> elementgroups;
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+    for (auto it = geo.getElementGroupTable(owner).beginTraverse(); !it.atEnd(); ++it) {
+      if (it.group()->isInternal())
+        elementgroups.append(it.group());
+    }
+  }
+  UT_Array<GA_EdgeGroup*> edgegroups;
+  for (auto it = geo.edgeGroups().beginTraverse(); !it.atEnd(); ++it) {
+    if (it.group()->isInternal())
+      edgegroups.append(it.group());
+  }
+  for (GA_ElementGroup* group : elementgroups)
+    geo.destroyElementGroup(group);
+  for (GA_EdgeGroup* group : edgegroups)
+    geo.destroyEdgeGroup(group);
+}
+
+
+// Returns true if a source can be merged without the copy chain: polygons only, stored without holes.
+static bool isParallelMergeable(const GU_Detail& geo) {
+  return geo.getPointMap().isTrivialMap() && geo.getVertexMap().isTrivialMap()
+         && geo.getPrimitiveMap().isTrivialMap()
+         && geo.countPrimitiveType(GA_PRIMPOLY) == geo.getNumPrimitives();
+}
+
+
+// Elements of one attribute copied from one source: source offsets are either 0..size-1, or srcoffsets.
+struct AttributeCopy {
+  GA_Attribute* dest;
+  const GA_Attribute* src;
+  GA_Offset deststart;
+  GA_Size size;
+  const GA_OffsetList* srcoffsets;
+  /** String handles of src, mapped to handles of dest. Empty unless dest is a string attribute. */
+  UT_Array<GA_StringIndexType> remap;
+  /** Holds the strings remap refers to until their handles are set. Null unless dest is a string attribute. */
+  std::unique_ptr<GA_AIFSharedStringTuple::StringBuffer> strings;
+};
+
+
+// Copies every source into its planned ranges concurrently. Returns false, leaving gdp untouched,
+// unless there are several sources and all of them can be merged this way.
+static bool mergeInParallel(GU_Detail& gdp, const std::vector<MergeSource>& sources, const MergePlan& plan) {
+  int count = 0;
+  for (const MergeSource& source : sources) {
+    if (!source.cookedgdp)
+      continue;
+    if (!isParallelMergeable(*source.cookedgdp))
+      return false;
+    count++;
+  }
+  if (count < 2)
+    return false;
+
+  gdp.clearAndDestroy();
+  applyMergeSchema(gdp, plan);
+  // Detail attributes hold one value, which comes from the first source that has it.
+  std::set<std::string> detailattribs;
+  for (const MergeSource& source : sources) {
+    if (!source.cookedgdp)
+      continue;
+    for (auto it = source.cookedgdp->getAttributeDict(GA_ATTRIB_DETAIL).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+      if (!detailattribs.insert(it.attrib()->getName().toStdString()).second)
+        continue;
+      GA_Attribute* attr = gdp.findAttribute(GA_ATTRIB_DETAIL, it.attrib()->getName());
+      if (!attr)
+        attr = gdp.getAttributes().cloneAttribute(GA_ATTRIB_DETAIL, it.attrib()->getName(), *it.attrib(), true);
+      if (attr)
+        attr->copy(GA_Offset(0), *it.attrib(), GA_Offset(0));
+    }
+  }
+
+  // Topology is built serially, one block of polygons per run of open or closed polygons.
+  // The vertices of each source are appended in primitive order, which need not be the order they are stored in.
+  gdp.appendPointBlock(plan.numpoints);
+  std::vector<GA_OffsetList> srcvertices(sources.size());
+  std::vector<UT_Array<GA_Offset>> vertexdests(sources.size());
+  for (size_t i = 0; i < sources.size(); i++) {
+    const GU_Detail* geo = sources[i].cookedgdp;
+    if (!geo)
+      continue;
+    GA_PolyCounts sizes;
+    UT_IntArray ptnums;
+    bool closed = true;
+    auto buildPolygons = [&]() {
+      if (sizes.getNumPolygons() > 0)
+        GEO_PrimPoly::buildBlock(&gdp, GA_Offset(plan.ranges[i].points.start), geo->getNumPoints(), sizes, ptnums.array(), closed);
+      sizes.clear();
+      ptnums.clear();
+    };
+    vertexdests[i].setSizeNoInit(geo->getNumVertices());
+    for (GA_Iterator it(geo->getPrimitiveRange()); !it.atEnd(); ++it) {
+      const GEO_PrimPoly* poly = static_cast<const GEO_PrimPoly*>(geo->getGEOPrimitive(*it));
+      if (poly->isClosed() != closed) {
+        buildPolygons();
+        closed = poly->isClosed();
+      }
+      GA_Size n = poly->getVertexCount();
+      sizes.append(n);
+      for (GA_Size k = 0; k < n; k++) {
+        GA_Offset vtx = poly->getVertexOffset(k);
+        vertexdests[i](vtx) = GA_Offset(plan.ranges[i].vertices.start + srcvertices[i].size());
+        srcvertices[i].append(vtx);
+        ptnums.append((int) geo->vertexPoint(vtx));
+      }
+    }
+    buildPolygons();
+  }
+
+  // Numeric data of every source goes into its own range, so all of it can be copied at once. Strings are
+  // mapped to the string table of gdp up front, and their handles are set on one thread, as setting a handle
+  // updates the reference counts of the table. The buffers which added the strings keep them referenced
+  // until then.
+  std::vector<AttributeCopy> copies;
+  std::vector<AttributeCopy> stringcopies;
+  std::vector<AttributeCopy> serialcopies;
+  for (size_t i = 0; i < sources.size(); i++) {
+    const GU_Detail* geo = sources[i].cookedgdp;
+    if (!geo)
+      continue;
+    for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+      for (auto it = geo->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+        GA_Attribute* dest = gdp.findAttribute(owner, it.attrib()->getName());
+        if (!dest)
+          continue;
+        AttributeCopy copy;
+        copy.dest = dest;
+        copy.src = it.attrib();
+        const ams::core::SourceRanges& ranges = plan.ranges[i];
+        copy.deststart = GA_Offset(owner == GA_ATTRIB_POINT ? ranges.points.start
+                                   : owner == GA_ATTRIB_VERTEX ? ranges.vertices.start : ranges.prims.start);
+        copy.size = geo->getIndexMap(owner).indexSize();
+        copy.srcoffsets = owner == GA_ATTRIB_VERTEX ? &srcvertices[i] : nullptr;
+        const GA_AIFSharedStringTuple* destaif = dest->getAIFSharedStringTuple();
+        const GA_AIFSharedStringTuple* srcaif = copy.src->getAIFSharedStringTuple();
+        if (destaif && srcaif && dest->getTupleSize() == 1 && copy.src->getTupleSize() == 1) {
+          copy.strings.reset(new GA_AIFSharedStringTuple::StringBuffer(dest, destaif));
+          for (auto string = srcaif->begin(copy.src); !string.atEnd(); ++string) {
+            GA_StringIndexType handle = string.getIndex();
+            while (copy.remap.size() <= handle)
+              copy.remap.append(GA_StringIndexType(-1));
+            copy.remap(handle) = copy.strings->append(string.getString());
+          }
+          stringcopies.push_back(std::move(copy));
+        } else if (dest->getAIFTuple() && !destaif) {
+          copies.push_back(std::move(copy));
+        } else {
+          serialcopies.push_back(std::move(copy));
+        }
+      }
+    }
+  }
+  auto srcRange = [](const AttributeCopy& copy, GA_Size start, GA_Size end) {
+    if (!copy.srcoffsets)
+      return GA_Range(copy.src->getIndexMap(), GA_Offset(start), GA_Offset(end));
+    GA_OffsetList offsets;
+    for (GA_Size i = start; i < end; i++)
+      offsets.append((*copy.srcoffsets)(i));
+    return GA_Range(copy.src->getIndexMap(), offsets);
+  };
+  for (auto& copy : copies) {
+    copy.dest->hardenAllPages();
+  }
+  // Large sources are split into chunks, so a few big objects don't leave the other threads idle.
+  const GA_Size chunksize = GA_PAGE_SIZE * 16;
+  std::vector<std::pair<int, GA_Size>> chunks;
+  for (int i = 0; i < (int) copies.size(); i++) {
+    for (GA_Size start = 0; start < copies[i].size; start += chunksize)
+      chunks.push_back({i, start});
+  }
+  UTparallelForEachNumber((exint) chunks.size(), [&](const UT_BlockedRange<exint>& range) {
+    for (exint c = range.begin(); c != range.end(); ++c) {
+      const AttributeCopy& copy = copies[chunks[c].first];
+      GA_Size start = chunks[c].second;
+      GA_Size end = SYSmin(start + chunksize, copy.size);
+      copy.dest->copy(GA_Range(copy.dest->getIndexMap(), copy.deststart + start, copy.deststart + end),
+                      *copy.src, srcRange(copy, start, end));
+    }
+  }, true);
+  for (const auto& copy : stringcopies) {
+    const GA_AIFSharedStringTuple* srcaif = copy.src->getAIFSharedStringTuple();
+    const GA_AIFSharedStringTuple* destaif = copy.dest->getAIFSharedStringTuple();
+    for (GA_Size i = 0; i < copy.size; i++) {
+      GA_Offset srcoffset = copy.srcoffsets ? (*copy.srcoffsets)(i) : GA_Offset(i);
+      GA_StringIndexType handle = srcaif->getHandle(copy.src, srcoffset, 0);
+      if (handle >= 0 && handle < copy.remap.size())
+        destaif->setHandle(copy.dest, copy.deststart + i, copy.remap(handle), 0);
+    }
+  }
+  for (const auto& copy : serialcopies) {
+    copy.dest->copy(GA_Range(copy.dest->getIndexMap(), copy.deststart, copy.deststart + copy.size),
+                    *copy.src, srcRange(copy, 0, copy.size));
+  }
+
+  // Each group is filled by its own task, from every source which has it.
+  std::vector<std::pair<GA_GroupType, UT_StringHolder>> groups(plan.groups);
+  UTparallelForEachNumber((exint) groups.size(), [&](const UT_BlockedRange<exint>& range) {
+    for (exint g = range.begin(); g != range.end(); ++g) {
+      GA_GroupType type = groups[g].first;
+      const char* name = groups[g].second.c_str();
+      for (size_t i = 0; i < sources.size(); i++) {
+        const GU_Detail* geo = sources[i].cookedgdp;
+        if (!geo)
+          continue;
+        if (type == GA_GROUP_EDGE) {
+          const GA_EdgeGroup* srcgroup = geo->findEdgeGroup(name);
+          GA_EdgeGroup* destgroup = gdp.findEdgeGroup(name);
+          if (!srcgroup || !destgroup)
+            continue;
+          for (auto it = srcgroup->begin(); it != srcgroup->end(); ++it) {
+            GA_Offset pointstart(plan.ranges[i].points.start);
+            destgroup->add(pointstart + it->p0(), pointstart + it->p1());
+          }
+          continue;
+        }
+        const GA_ElementGroup* srcgroup = geo->getElementGroupTable(GA_AttributeOwner(type)).find(name);
+        GA_ElementGroup* destgroup = gdp.getElementGroupTable(GA_AttributeOwner(type)).find(name);
+        if (!srcgroup || !destgroup)
+          continue;
+        for (GA_Iterator it(GA_Range(*srcgroup)); !it.atEnd(); ++it) {
+          if (type == GA_GROUP_VERTEX)
+            destgroup->addOffset(vertexdests[i](*it));
+          else
+            destgroup->addOffset(GA_Offset(type == GA_GROUP_POINT ? plan.ranges[i].points.start
+                                                                  : plan.ranges[i].prims.start) + *it);
+        }
+      }
+    }
+  }, true);
+  gdp.bumpAllDataIds();
+  return true;
+}
+
+
+// A merged source whose transform is deferred to the page pass, and the ranges it was copied into.
+struct TransformJob {
+  const GU_Detail* source;
+  GA_Range points, vertices, prims;
+  UT_Matrix4D xform;
+};
+
+// A run of offsets within a single page, and the job it belongs to.
+struct TransformBlock {
+  GA_Offset start, end;
+  int job;
+};
+
+
+// Returns true if the page pass can transform the attribute: a 3 float tuple holding a position, vector or normal.
+static bool isPageTransformable(const GA_Attribute* attr) {
+  const GA_AIFTuple* tuple = attr->getAIFTuple();
+  if (!tuple || attr->getTupleSize() != 3)
+    return false;
+  GA_Storage storage = tuple->getStorage(attr);
+  if (storage != GA_STORE_REAL32 && storage != GA_STORE_REAL64)
+    return false;
+  GA_TypeInfo type = attr->getTypeInfo();
+  return type == GA_TYPE_POINT || type == GA_TYPE_VECTOR || type == GA_TYPE_NORMAL;
+}
+
+
+// Returns true if the transform of a source can be deferred to the page pass. Anything the pass doesn't
+// handle itself, like primitives with their own transform or a mirroring transform which reverses
+// primitives, is left to GEO_Detail::transform.
+static bool canDeferTransform(const GU_Detail& geo, const UT_Matrix4D& xform) {
+  if (xform.determinant3() < 0 || !hasOnlyPointTransforms(geo))
+    return false;
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+    for (auto it = geo.getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+      if (it.attrib()->needsTransform() && !isPageTransformable(it.attrib()))
+        return false;
+    }
+  }
+  return true;
+}
+
+
+// Splits a range into runs of offsets which don't cross a page boundary.
+static void appendPageBlocks(const GA_Range& range, int job, std::vector<TransformBlock>& blocks) {
+  GA_Offset start, end;
+  for (GA_Iterator it(range); it.blockAdvance(start, end);) {
+    while (start < end) {
+      GA_Offset pageend = SYSmin(end, GA_Offset((GAgetPageNum(start) + 1) * GA_PAGE_SIZE));
+      blocks.push_back({start, pageend, job});
+      start = pageend;
+    }
+  }
+}
+
+
+// Transforms one attribute over all blocks. Each block reads and writes a contiguous array within one
+// page, which the transform kernel of the merge core runs over as packed vectors.
+template <typename T>
+static void transformPages(GA_Attribute* attr, const std::vector<TransformBlock>& blocks,
+                           const std::vector<TransformJob>& jobs) {
+  typedef typename GA_PageHandleV<UT_Vector3T<T>>::RWType PageHandle;
+  std::vector<ams::core::VectorTransform> xforms;
+  ams::core::TypeInfo type = ams::toCoreTypeInfo(attr->getTypeInfo());
+  for (const TransformJob& job : jobs)
+    xforms.emplace_back(ams::toCoreMatrix(job.xform), type);
+  // Blocks of neighbouring sources may share a page, so pages are hardened before they are written concurrently.
+  // Only the pages being transformed are hardened. The others may still be shared with a cooked detail.
+  for (const TransformBlock& block : blocks)
+    attr->hardenAllPages(block.start, block.end);
+  UTparallelFor(UT_BlockedRange<exint>(0, (exint) blocks.size()), [&](const UT_BlockedRange<exint>& range) {
+    PageHandle handle(attr);
+    for (exint i = range.begin(); i != range.end(); ++i) {
+      const TransformBlock& block = blocks[i];
+      handle.setPage(block.start);
+      ams::core::transformPacked(handle.value(block.start).data(), (size_t) (block.end - block.start),
+                                 xforms[block.job]);
+    }
+  });
+  attr->bumpDataId();
+}
+
+
+// Applies the deferred transforms of all sources in one pass per attribute, instead of one serial
+// GEO_Detail::transform per source. Only attributes a source actually had are transformed over its ranges.
+static void applyTransforms(GU_Detail& geo, const std::vector<TransformJob>& jobs) {
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+    std::map<std::string, std::vector<int>> attribjobs;
+    for (int i = 0; i < (int) jobs.size(); i++) {
+      for (auto it = jobs[i].source->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+        if (it.attrib()->needsTransform())
+          attribjobs[it.attrib()->getName().toStdString()].push_back(i);
+      }
+    }
+    for (auto& entry : attribjobs) {
+      GA_Attribute* attr = geo.findAttribute(owner, entry.first.c_str());
+      if (!attr || !isPageTransformable(attr))
+        continue;
+      std::vector<TransformBlock> blocks;
+      for (int i : entry.second) {
+        const TransformJob& job = jobs[i];
+        appendPageBlocks(owner == GA_ATTRIB_POINT ? job.points
+                         : owner == GA_ATTRIB_VERTEX ? job.vertices : job.prims, i, blocks);
+      }
+      if (attr->getAIFTuple()->getStorage(attr) == GA_STORE_REAL64)
+        transformPages<fpreal64>(attr, blocks, jobs);
+      else
+        transformPages<fpreal32>(attr, blocks, jobs);
+    }
+  }
+}
+
+
+// Returns the start of a range whose offsets are contiguous, or GA_INVALID_OFFSET if they aren't.
+static GA_Offset contiguousStart(const GA_Range& range) {
+  GA_Offset start, end;
+  GA_Iterator it(range);
+  if (!it.blockAdvance(start, end))
+    return GA_INVALID_OFFSET;
+  GA_Offset next, nextend;
+  return it.blockAdvance(next, nextend) ? GA_INVALID_OFFSET : start;
+}
+
+
+// The ranges a merged source occupies in gdp, which later references to the same detail are duplicated from.
+struct InstancePrototype {
+  GA_Range points, vertices, prims;
+};
+
+
+// Appends a copy of a source already merged into geo, element for element, and returns the new ranges.
+// Nothing is read from the cooked detail again: topology is rebuilt in blocks and every attribute and
+// group is copied within geo itself. Only polygon sources stored without holes can be duplicated, as
+// checked by isParallelMergeable. Returns false, leaving geo untouched, if the ranges aren't contiguous.
+static bool duplicateRanges(GU_Detail& geo, const InstancePrototype& prototype, InstancePrototype& instance) {
+  GA_Offset pointstart = contiguousStart(prototype.points);
+  GA_Offset primstart = contiguousStart(prototype.prims);
+  if (!GAisValid(pointstart) || !GAisValid(primstart))
+    return false;
+  GA_Size numpoints = prototype.points.getEntries();
+
+  GA_IndexMap::Marker vertexmarker(geo.getVertexMap());
+  GA_IndexMap::Marker primmarker(geo.getPrimitiveMap());
+  GA_Offset newpointstart = geo.appendPointBlock(numpoints);
+  // Vertices are rebuilt in primitive order, which need not be the order the prototype stores them in.
+  GA_OffsetList srcvertices;
+  GA_PolyCounts sizes;
+  UT_IntArray ptnums;
+  bool closed = true;
+  auto buildPolygons = [&]() {
+    if (sizes.getNumPolygons() > 0)
+      GEO_PrimPoly::buildBlock(&geo, newpointstart, numpoints, sizes, ptnums.array(), closed);
+    sizes.clear();
+    ptnums.clear();
+  };
+  for (GA_Iterator it(prototype.prims); !it.atEnd(); ++it) {
+    const GEO_PrimPoly* poly = static_cast<const GEO_PrimPoly*>(geo.getGEOPrimitive(*it));
+    if (poly->isClosed() != closed) {
+      buildPolygons();
+      closed = poly->isClosed();
+    }
+    GA_Size n = poly->getVertexCount();
+    sizes.append(n);
+    for (GA_Size k = 0; k < n; k++) {
+      GA_Offset vtx = poly->getVertexOffset(k);
+      srcvertices.append(vtx);
+      ptnums.append((int) (geo.vertexPoint(vtx) - pointstart));
+    }
+  }
+  buildPolygons();
+  instance.points = GA_Range(geo.getPointMap(), newpointstart, newpointstart + numpoints);
+  instance.vertices = vertexmarker.getRange();
+  instance.prims = primmarker.getRange();
+  GA_Offset newvertexstart = contiguousStart(instance.vertices);
+  GA_Offset newprimstart = contiguousStart(instance.prims);
+
+  GA_Range srcvertexrange(geo.getVertexMap(), srcvertices);
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+    const GA_Range& src = owner == GA_ATTRIB_POINT ? prototype.points
+                          : owner == GA_ATTRIB_VERTEX ? srcvertexrange : prototype.prims;
+    const GA_Range& dest = owner == GA_ATTRIB_POINT ? instance.points
+                           : owner == GA_ATTRIB_VERTEX ? instance.vertices : instance.prims;
+    for (auto it = geo.getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+      it.attrib()->copy(dest, *it.attrib(), src);
+      it.attrib()->bumpDataId();
+    }
+  }
+
+  // Group membership is mapped by position within the ranges.
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE}) {
+    for (auto it = geo.getElementGroupTable(owner).beginTraverse(); !it.atEnd(); ++it) {
+      GA_ElementGroup* group = it.group();
+      if (group->isInternal() || group->isEmpty())
+        continue;
+      if (owner == GA_ATTRIB_VERTEX) {
+        for (exint i = 0; i < srcvertices.entries(); i++) {
+          if (group->contains(srcvertices(i)))
+            group->addOffset(newvertexstart + i);
+        }
+      } else {
+        GA_Offset srcstart = owner == GA_ATTRIB_POINT ? pointstart : primstart;
+        GA_Offset deststart = owner == GA_ATTRIB_POINT ? newpointstart : newprimstart;
+        for (GA_Iterator offset(owner == GA_ATTRIB_POINT ? prototype.points : prototype.prims); !offset.atEnd(); ++offset) {
+          if (group->contains(*offset))
+            group->addOffset(deststart + (*offset - srcstart));
+        }
+      }
+      group->bumpDataId();
+    }
+  }
+  for (auto it = geo.edgeGroups().beginTraverse(); !it.atEnd(); ++it) {
+    GA_EdgeGroup* group = it.group();
+    if (group->isInternal())
+      continue;
+    std::vector<std::pair<GA_Offset, GA_Offset>> edges;
+    for (auto edge = group->begin(); edge != group->end(); ++edge) {
+      GA_Offset p0 = edge->p0(), p1 = edge->p1();
+      if (p0 >= pointstart && p0 < pointstart + numpoints && p1 >= pointstart && p1 < pointstart + numpoints)
+        edges.push_back({newpointstart + (p0 - pointstart), newpointstart + (p1 - pointstart)});
+    }
+    for (auto& edge : edges)
+      group->add(edge.first, edge.second);
+    group->bumpDataId();
+  }
+  geo.getTopology().bumpDataIds();
+  geo.getPrimitiveList().bumpDataId();
+  return true;
+}
+
+
+// A table of unique paths. Primitives store the index of their path, rather than the path itself.
+class PathTable {
+public:
+  int32 index(const UT_StringHolder& path) {
+    auto found = myIndices.find(path);
+    if (found != myIndices.end())
+      return found->second;
+    int32 index = (int32) myPaths.size();
+    myIndices.emplace(path, index);
+    myPaths.append(path);
+    return index;
+  }
+
+  const UT_StringArray& paths() const { return myPaths; }
+
+private:
+  UT_StringMap<int32> myIndices;
+  UT_StringArray myPaths;
+};
+
+
+GA_Attribute* primIndexAttribute(GU_Detail& geo, const UT_StringHolder& name) {
+  GA_Attribute* attr = geo.findPrimitiveAttribute(name);
+  if (!attr)
+    attr = geo.addIntTuple(GA_ATTRIB_PRIMITIVE, name, 1, GA_Defaults(-1));
+  return attr;
+}
+
+
+void fillIndexAttribute(GA_Attribute* attr, const GA_Range& range, int32 value) {
+  if (!attr || range.isEmpty())
+    return;
+  UTparallelForLightItems(GA_SplittableRange(range), [&](const GA_SplittableRange& subrange) {
+    GA_PageHandleScalar<int32>::RWType handle(attr);
+    GA_Offset start, end;
+    for (GA_PageIterator pit = subrange.beginPages(); !pit.atEnd(); ++pit) {
+      for (GA_Iterator it(pit.begin()); it.blockAdvance(start, end);) {
+        handle.setPage(start);
+        for (GA_Offset offset = start; offset < end; ++offset)
+          handle.value(offset) = value;
+      }
+    }
+  });
+  attr->bumpDataId();
+}
+
+
+// Writes a path table to a detail string array, rewritten by the programs of the rules which target
+// the path attribute, so both encodings hold the same paths.
+static void writePathTable(GU_Detail& geo, const char* base, const PathTable& table,
+                           const std::vector<const CompiledReplace*>& programs) {
+  UT_StringArray paths(table.paths());
+  for (const CompiledReplace* program : programs) {
+    for (exint i = 0; i < paths.size(); i++)
+      paths(i) = UT_StringHolder((*program)(paths(i).toStdString()));
+  }
+  GA_RWHandleSA handle(geo.addStringArray(GA_ATTRIB_DETAIL, tableAttribName(base)));
+  if (handle.isValid()) {
+    handle.set(GA_Offset(0), paths);
+    handle.bumpDataId();
+  }
+}
+
+
+MergeResult mergeSources(GU_Detail& gdp, const std::vector<MergeSource>& sources, const MergeOptions& options,
+                         MergeHost& host, MergeStats& stats) {
+  OP_Node* self = host.node();
+  UT_StringHolder label(self ? self->getFullPath() : UT_StringHolder());
+  bool pack = options.pack;
+
+  // PATH ATTRIB
+  // Paths are written as strings, as indices into a detail table of unique paths, or both.
+  bool writepathstrings = options.pathencoding != PATH_ENCODING_INDEXED;
+  bool writepathindices = options.pathencoding != PATH_ENCODING_STRINGS;
+  bool enablepathattrib = options.enablepathattrib;
+  const char* pathattribname = options.pathattrib.c_str();
+  if (enablepathattrib && !options.pathattrib.isstring()) {
+    host.addWarning(SOP_ErrorCodes::SOP_ATTRIBUTE_INVALID);
+    enablepathattrib = false;
+  }
+  // NODE PATH ATTRIB
+  bool enable_nodepathattrib = options.enablenodepathattrib;
+  const char* nodepathattribname = options.nodepathattrib.c_str();
+  if (enable_nodepathattrib && !options.nodepathattrib.isstring()) {
+    host.addWarning(SOP_ErrorCodes::SOP_ATTRIBUTE_INVALID);
+    enable_nodepathattrib = false;
+  }
+  // RESOLVE MATS
+  bool resolve_mats = options.resolvemats;
+  UT_StringHolder hintpath;
+  if (resolve_mats)
+    hintpath = host.materials().resolveHintPath(self, options.hintpath);
+
+  // The last source that cooked successfully ends the copy chain.
+  int lastsource = -1;
+  for (int i = 0; i < (int) sources.size(); i++) {
+    if (sources[i].cookedgdp)
+      lastsource = i;
+  }
+  // Plan the whole merge before copying, so gdp goes through a single schema change.
+  MergePlan plan = planMerge(sources);
+  // MAIN LOOP
+  // Sources are merged in objpath# order, regardless of the order in which they cooked.
+  bool copiedfirst = false;
+  bool copiedlast = false;
+  PhaseTimer copytimer("Copy Objects", label.c_str(), stats.copytime);
+  stats.sourcemergetimes.assign(sources.size(), 0.0);
+  stats.sourceprims.assign(sources.size(), 0);
+  PathTable pathtable, nodepathtable;
+  // Transforms of copied sources are applied together after the loop.
+  std::vector<TransformJob> transformjobs;
+  transformjobs.reserve(sources.size());
+  // Copy chain sources by cooked detail and, when materials are resolved, by object. Later references
+  // to the same detail are duplicated from these ranges instead of copying the detail again.
+  // The parallel merge copies every source from its cooked detail, so it never duplicates; it is left
+  // off whenever the parallel merge is asked for, so the output doesn't depend on which path ran.
+  bool dedupe = !options.mergeparallel;
+  std::map<std::pair<const GU_Detail*, const OP_Network*>, InstancePrototype> prototypes;
+  // Sources made of plain polygons can be appended concurrently, each into its own planned ranges.
+  bool mergedparallel = !pack && options.mergeparallel && mergeInParallel(gdp, sources, plan);
+  if (mergedparallel)
+    copiedfirst = copiedlast = true;
+  if (pack) {
+    // Packed primitives are appended one by one rather than through the copy chain.
+    gdp.clearAndDestroy();
+    copiedfirst = copiedlast = true;
+  }
+  size_t copiedsources = 0;
+  for (int sourceindex = 0; sourceindex < (int) sources.size(); sourceindex++) {
+    const MergeSource& source = sources[sourceindex];
+    OP_Network * objptr = source.objptr;
+    const GU_Detail* cookedgdp = source.cookedgdp;
+    if (!cookedgdp) {
+      // Something went wrong with the cooking. Warn the hapless user.
+      host.addWarning(SOP_BAD_SOP_MERGED, source.soppath.c_str());
+      continue;
+    }
+    // The merge time of a source includes its tagging and materials, which the phase totals keep apart.
+    PhaseTimer sourcetimer("Merge Object", source.soppath.c_str(), stats.sourcemergetimes[sourceindex]);
+    GA_Range primrange;
+    bool instanced = false;
+    if (pack) {
+      // The source becomes a single packed primitive which shares the cooked detail instead of copying it.
+      // Sources which share a detail, filtered or not, become instances of the same geometry.
+      GA_IndexMap::Marker primmarker(gdp.getPrimitiveMap());
+      GU_PrimPacked* packed = GU_PackedGeometry::packGeometry(gdp, source.cookedgdh);
+      if (!packed) {
+        host.addWarning(SOP_BAD_SOP_MERGED, source.soppath.c_str());
+        continue;
+      }
+      if (source.transformed) {
+        UT_Vector3D translate;
+        source.xform.getTranslates(translate);
+        packed->setLocalTransform(UT_Matrix3D(source.xform));
+        gdp.setPos3(packed->getPointOffset(0), translate);
+      }
+      primrange = primmarker.getRange();
+    } else {
+      const core::SourceRanges& ranges = plan.ranges[sourceindex];
+      GA_Range pointrange, vertexrange;
+      auto prototypekey = std::make_pair(cookedgdp, resolve_mats ? (const OP_Network*) objptr : nullptr);
+      auto prototype = dedupe ? prototypes.find(prototypekey) : prototypes.end();
+      InstancePrototype instance;
+      if (mergedparallel) {
+        // Already in place. gdp was built from scratch, so offsets are the planned indices.
+        pointrange = GA_Range(gdp.getPointMap(), GA_Offset(ranges.points.start),
+                              GA_Offset(ranges.points.start + ranges.points.size));
+        vertexrange = GA_Range(gdp.getVertexMap(), GA_Offset(ranges.vertices.start),
+                               GA_Offset(ranges.vertices.start + ranges.vertices.size));
+        primrange = GA_Range(gdp.getPrimitiveMap(), GA_Offset(ranges.prims.start),
+                             GA_Offset(ranges.prims.start + ranges.prims.size));
+      } else if (prototype != prototypes.end() && duplicateRanges(gdp, prototype->second, instance)) {
+        // Its path attributes are tagged again below. Materials were resolved for the same object already.
+        instanced = true;
+        pointrange = instance.points;
+        vertexrange = instance.vertices;
+        primrange = instance.prims;
+      } else {
+        bool firstmerge = !copiedfirst;
+        // Choose the best copy method we can. The first source replaces gdp instead of starting a copy.
+        GEO_CopyMethod copymethod = GEO_COPY_ADD;
+        copiedfirst = true;
+        if (sourceindex == lastsource) {
+          copymethod = GEO_COPY_END;
+          copiedlast = true;
+        }
+        // Mark where the new prims and points start
+        GA_IndexMap::Marker pointmarker(gdp.getPointMap());
+        GA_IndexMap::Marker vertexmarker(gdp.getVertexMap());
+        GA_IndexMap::Marker primmarker(gdp.getPrimitiveMap());
+
+        if (firstmerge) {
+          // The first source starts the chain by sharing its pages with gdp rather than copying them.
+          // A page is only duplicated once something writes to it, e.g. a transform or the path
+          // attributes, so an unmodified source costs next to no memory.
+          gdp.replaceWith(*cookedgdp);
+          destroyInternalGroups(gdp);
+          // Its schema is extended with the attributes and groups of the remaining sources right away.
+          applyMergeSchema(gdp, plan);
+        } else {
+          // Don't copy internal groups!
+          // Accumulation of internal groups may ensue.
+          gdp.copy(*cookedgdp, copymethod, true, false, GA_DATA_ID_CLONE);
+        }
+        if (firstmerge) {
+          // for loop doesn't evaluate the markers on first run. The first merge starts a new detail,
+          // so its ranges are everything copied so far.
+          pointrange = GA_Range(gdp.getPointMap(), GA_Offset(0), gdp.getPointMap().offsetSize());
+          vertexrange = GA_Range(gdp.getVertexMap(), GA_Offset(0), gdp.getVertexMap().offsetSize());
+          primrange = GA_Range(gdp.getPrimitiveMap(), GA_Offset(0), gdp.getPrimitiveMap().offsetSize());
+        } else {
+          pointrange = pointmarker.getRange();
+          vertexrange = vertexmarker.getRange();
+          primrange = primmarker.getRange();
+        }
+      }
+      // Apply the transform.
+      bool untransformed = true;
+      if (source.transformed) {
+        if (canDeferTransform(*cookedgdp, source.xform)) {
+          transformjobs.push_back({cookedgdp, pointrange, vertexrange, primrange, source.xform});
+        } else {
+          gdp.transform(source.xform, primrange, pointrange, false);
+          untransformed = false;
+        }
+      }
+      // Instances copy the ranges before the deferred transforms run, so only untransformed ranges can be prototypes.
+      if (dedupe && !instanced && untransformed && isParallelMergeable(*cookedgdp))
+        prototypes.emplace(prototypekey, InstancePrototype{pointrange, vertexrange, primrange});
+      copiedsources++;
+    }
+
+    stats.sourceprims[sourceindex] = primrange.getEntries();
+    PhaseTimer tagtimer("Tag Paths", source.soppath.c_str(), stats.tagtime);
+    if (enablepathattrib) {
+      if (writepathstrings)
+        fillStringAttribute(primStringAttribute(gdp, pathattribname), primrange, source.hierpath.c_str());
+      if (writepathindices)
+        fillIndexAttribute(primIndexAttribute(gdp, indexAttribName(pathattribname)), primrange,
+                           pathtable.index(source.hierpath));
+    }
+
+    if (enable_nodepathattrib) {
+      if (writepathstrings)
+        fillStringAttribute(primStringAttribute(gdp, nodepathattribname), primrange, source.nodepath.c_str());
+      if (writepathindices)
+        fillIndexAttribute(primIndexAttribute(gdp, indexAttribName(nodepathattribname)), primrange,
+                           nodepathtable.index(source.nodepath));
+    }
+
+    tagtimer.stop();
+
+    // Geometry which doesn't come from an object has no materials to resolve.
+    if (resolve_mats && !instanced && objptr) {
+      PhaseTimer materialtimer("Resolve Materials", source.soppath.c_str(), stats.materialtime);
+      resolveMaterials(gdp, primrange, *objptr, host.materials(), hintpath, options.matchnames);
+    }
+  }
+  if (pack)
+    gdp.bumpAllDataIds();
+  copytimer.stop();
+  {
+    PhaseTimer transformtimer("Transform Objects", label.c_str(), stats.transformtime);
+    applyTransforms(gdp, transformjobs);
+  }
+  // Tagging and materials were timed within the copy phase.
+  stats.copytime -= stats.tagtime + stats.materialtime;
+
+  {
+    // Rewrites are applied to the whole string tables, once everything is merged.
+    PhaseTimer rewritetimer("Rewrite Strings", label.c_str(), stats.rewritetime);
+    for (auto& rule : options.rules) {
+      rewriteStringAttributes(gdp, rule.attribs.c_str(), *rule.program);
+    }
+    // The path tables are rewritten by the same rules, so both encodings hold the same paths.
+    auto tablePrograms = [&options](const char* base) {
+      std::vector<const CompiledReplace*> programs;
+      for (auto& rule : options.rules) {
+        if (UT_String(base).multiMatch(rule.attribs.c_str()))
+          programs.push_back(rule.program.get());
+      }
+      return programs;
+    };
+    if (enablepathattrib && writepathindices)
+      writePathTable(gdp, pathattribname, pathtable, tablePrograms(pathattribname));
+    if (enable_nodepathattrib && writepathindices)
+      writePathTable(gdp, nodepathattribname, nodepathtable, tablePrograms(nodepathattribname));
+  }
+
+  // Finish & clean up the copy procedure, if not already done.
+  if (!copiedfirst) {
+    gdp.clearAndDestroy();
+  } else if (!copiedlast) {
+    GU_Detail blank_gdp;
+    gdp.copy(blank_gdp, GEO_COPY_END, true, false, GA_DATA_ID_CLONE);
+  }
+
+  MergeResult result;
+  result.ranges = plan.ranges;
+  // Ranges can only be reused if every source was merged and gdp is laid out without holes.
+  result.laidout = !pack && lastsource >= 0 && copiedsources == sources.size()
+                   && gdp.getNumPoints() == plan.numpoints && gdp.getNumVertices() == plan.numvertices
+                   && gdp.getNumPrimitives() == plan.numprims && gdp.getPointMap().isTrivialMap()
+                   && gdp.getVertexMap().isTrivialMap() && gdp.getPrimitiveMap().isTrivialMap();
+  return result;
+}
+
+
+MergeResult mergeObjects(GU_Detail& gdp, const ParmSnapshot& snapshot, MergeHost& host, OP_Context& context,
+                         MergeStats& stats) {
+  std::vector<MergeSource> sources = gatherSources(snapshot, host, context, stats);
+  return mergeSources(gdp, sources, snapshot.options, host, stats);
+}
+
+}
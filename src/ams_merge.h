@@ -0,0 +1,354 @@
+// The object merge, without the state a node keeps between cooks, so the SOP, its verb and the
+// command line merge tool all merge the same way.
+
+#pragma once
+#include "ams_utils.h"
+#include "ams_mergecore.h"
+#include <GA/GA_Range.h>
+#include <GU/GU_Detail.h>
+#include <GU/GU_DetailHandle.h>
+#include <OP/OP_Node.h>
+#include <SOP/SOP_Error.h>
+#include <UT/UT_Matrix4.h>
+#include <UT/UT_StopWatch.h>
+#include <UT/UT_String.h>
+#include <UT/UT_StringHolder.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+class OP_Context;
+class OP_Network;
+class SOP_Node;
+
+
+namespace ams {
+
+/** @brief the values of the path_encoding menu. */
+enum PathEncoding {
+  PATH_ENCODING_STRINGS = 0,
+  PATH_ENCODING_INDEXED,
+  PATH_ENCODING_BOTH
+};
+
+/** @brief the patterns of the attributes and groups removed from every source before it is merged. */
+struct SourceFilter {
+  /** @brief indexed by GA_AttributeOwner. */
+  UT_String attribs[GA_ATTRIB_OWNER_N];
+  /** @brief applies to groups of every type. */
+  UT_String groups;
+};
+
+/** @brief a rewrite rule, with its replacement compiled. */
+struct RewriteRule {
+  /** @brief the names or wildcards of the string attributes to rewrite. */
+  UT_StringHolder attribs;
+  std::shared_ptr<const CompiledReplace> program;
+};
+
+/** @brief the options of a merge, evaluated from the parameters of the node or the verb. */
+struct MergeOptions {
+  bool pack = false;
+  bool cookparallel = false;
+  bool mergeparallel = false;
+  bool resolvemats = false;
+  /** @brief relative to the node being cooked. */
+  UT_StringHolder hintpath;
+  bool matchnames = false;
+  bool enablepathattrib = false;
+  UT_StringHolder pathattrib;
+  bool resolvesubnets = false;
+  bool enablenodepathattrib = false;
+  UT_StringHolder nodepathattrib;
+  int pathencoding = PATH_ENCODING_STRINGS;
+  /** @brief the object the merged geometry is made relative to. Relative to the node being cooked. */
+  UT_StringHolder xformpath;
+  SourceFilter filter;
+  std::vector<RewriteRule> rules;
+};
+
+/** @brief an objpath# entry, as evaluated by the parameter snapshot. */
+struct ObjectEntry {
+  int objindex;
+  bool enabled;
+  /** @brief the evaluated path. Only evaluated for enabled entries. */
+  UT_StringHolder path;
+  /** @brief bundle membership changes without node events, so bundles are expanded on every use. */
+  bool bundle;
+  /** @brief the nodes the path expanded to, unless it is a bundle. */
+  std::vector<OP_Node*> nodes;
+};
+
+/** @brief the evaluated parameters of a merge. */
+struct ParmSnapshot {
+  /** @brief bumped every time the snapshot is rebuilt. 0 if it was never built. */
+  exint version = 0;
+  bool valid = false;
+  /** @brief the time the entries were evaluated at. Only matters if timedependent is set. */
+  fpreal time = 0.0;
+  bool timedependent = false;
+  std::vector<ObjectEntry> entries;
+  /** @brief evaluated on every cook, unlike the entries. */
+  MergeOptions options;
+};
+
+/** @brief a SOP resolved from an objpath# entry, or a loaded file, along with its cooked geometry. */
+struct MergeSource {
+  /** @brief the objpath# instance or input this source was resolved from. */
+  int objindex;
+  /** @brief the SOP path, or the file name. */
+  UT_StringHolder soppath;
+  /** @brief null for geometry which doesn't come from a node. */
+  SOP_Node* sopptr;
+  /** @brief the object network which contains sopptr. Null along with sopptr. */
+  OP_Network* objptr;
+  /** @brief the geometry merged from sopptr. Empty until the source is cooked, or if the cook failed. */
+  GU_ConstDetailHandle cookedgdh;
+  const GU_Detail* cookedgdp;
+  /**
+   * @brief the detail sopptr cooked. cookedgdp may be a filtered copy of it, which is made anew every
+   * cook, so data ids are read from this one.
+   */
+  GU_ConstDetailHandle sourcegdh;
+  const GU_Detail* sourcegdp;
+  /** @brief the unique id of sourcegdp. */
+  exint cookedid;
+  /** @brief milliseconds spent cooking sopptr, including its inputs if they weren't cooked yet. */
+  fpreal cooktime;
+  /** @brief the transform applied to the merged geometry, if transformed is set. */
+  UT_Matrix4D xform;
+  bool transformed;
+  /** @brief the values of the path and node path attributes. */
+  UT_StringHolder hierpath;
+  UT_StringHolder nodepath;
+};
+
+/** @brief where the time of a merge went, in milliseconds. */
+struct MergeStats {
+  fpreal resolvetime = 0, cooktime = 0, copytime = 0, transformtime = 0;
+  fpreal tagtime = 0, materialtime = 0, rewritetime = 0, totaltime = 0;
+  /** @brief per source: time spent merging it, and the number of primitives it added. */
+  std::vector<fpreal> sourcemergetimes;
+  std::vector<exint> sourceprims;
+  /** @brief true if the sources were updated in place rather than merged again. */
+  bool incremental = false;
+};
+
+/** @brief where the sources of a merge ended up. */
+struct MergeResult {
+  /** @brief the points, vertices and primitives of each source, indexed like the sources. */
+  std::vector<core::SourceRanges> ranges;
+  /**
+   * @brief true if every source was copied into its ranges and the detail has no holes, so the ranges
+   * can be updated in place by a later cook.
+   */
+  bool laidout = false;
+};
+
+
+/**
+ * @brief times a phase of a merge and adds it to a total. While the performance monitor is recording,
+ * the phase is also recorded as an event nested in the cook of the node.
+ */
+class PhaseTimer {
+public:
+  PhaseTimer(const char* event, const char* object, fpreal& total);
+  ~PhaseTimer() { stop(); }
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+  void stop();
+
+private:
+  fpreal* myTotal;
+  int myEventId;
+  UT_StopWatch myTimer;
+};
+
+
+/**
+ * @brief hierarchy paths of objects, kept until a node they were built from is renamed or rewired.
+ * Safe to use from several cooks at once.
+ */
+class HierarchyPaths {
+public:
+  /** @brief the path of the transform hierarchy leading to node. Not to be confused with a node path. */
+  UT_StringHolder path(const OP_Node& node, bool resolve_subnets);
+
+  /** @brief drops every path if a watched node changed. Returns true if it did. */
+  bool refresh();
+
+private:
+  bool dropIfDirty();
+
+  std::recursive_mutex myLock;
+  /** @brief keyed by unique id and the resolve_subnets option. */
+  std::unordered_map<exint, std::string> myPaths;
+  NodeWatcher myWatcher{NodeWatcher::NAMES | NodeWatcher::INPUTS, &myLock};
+};
+
+
+/**
+ * @brief material lookups, kept until a material, or a network on the way to one, changes.
+ * The matnet a hint path leads to is scanned once and indexed, rather than searched by every lookup.
+ * Only material VOPs, material builders and SHOPs are indexed, not the nodes inside them.
+ * Safe to use from several cooks at once.
+ */
+class MaterialLibrary {
+public:
+  /** @brief a hint path, resolved from the node being cooked to a full path with a trailing '/'. */
+  UT_StringHolder resolveHintPath(OP_Node* relativeto, const UT_StringHolder& hintpath);
+
+  /**
+   * @brief the full path of the material matpath leads to, directly, from the hint path, or by name.
+   * An empty matpath looks up the object material instead. Empty if no material was found.
+   * @param hintpath a hint path returned by resolveHintPath().
+   */
+  UT_StringHolder lookup(const char* matpath, const UT_StringHolder& hintpath, bool matchnames,
+                         OP_Network& objptr, const UT_String& objshoppath);
+
+  /** @brief drops every lookup if a watched node changed. Returns true if it did. */
+  bool refresh();
+
+private:
+  /** @brief the materials inside a hint matnet. */
+  struct Index {
+    /** @brief materials by their path relative to the matnet. */
+    std::unordered_map<std::string, OP_Node*> relpaths;
+    /** @brief materials by node name. Names which occur more than once map to nullptr. */
+    std::unordered_map<std::string, OP_Node*> names;
+  };
+
+  /** @brief material path, hint path, name matching and, for empty material paths, object material. */
+  typedef std::tuple<std::string, std::string, bool, std::string> Key;
+
+  bool dropIfDirty();
+  const Index& index(const std::string& hintpath);
+  OP_Node* findIndexed(const UT_String& path, const std::string& hintpath, bool matchnames);
+
+  std::recursive_mutex myLock;
+  /** @brief cached lookups. Materials which couldn't be found are empty. */
+  std::map<Key, UT_StringHolder> myLookups;
+  /** @brief hint paths as typed, or relative to a node, resolved to full paths. */
+  std::map<std::string, std::string> myHintPaths;
+  std::map<std::string, Index> myIndices;
+  NodeWatcher myWatcher{NodeWatcher::NAMES | NodeWatcher::CHILDREN, &myLock};
+};
+
+
+/**
+ * @brief what a merge needs from whoever runs it: the node it cooks for, its dependencies, its errors,
+ * and the caches it keeps. The SOP, its verb and the command line merge tool each provide one.
+ */
+class MergeHost {
+public:
+  virtual ~MergeHost() = default;
+
+  /** @brief the node paths are relative to and phases are recorded for. Null outside of a cook. */
+  virtual OP_Node* node() = 0;
+
+  /** @brief the nodes an enabled objpath# entry leads to. */
+  virtual std::vector<OP_Node*> entryNodes(const ObjectEntry& entry) = 0;
+
+  /** @brief makes the merge cook again when node changes. */
+  virtual void addDependency(OP_Node* node, OP_InterestType type) = 0;
+
+  virtual void addWarning(SOP_ErrorCodes code, const char* msg = nullptr) = 0;
+
+  virtual void addError(SOP_ErrorCodes code, const char* msg = nullptr) = 0;
+
+  /** @brief reports a transform of node which couldn't be evaluated. */
+  virtual void addTransformError(const OP_Node& node, const char* label) = 0;
+
+  virtual HierarchyPaths& hierarchyPaths() = 0;
+
+  virtual MaterialLibrary& materials() = 0;
+};
+
+
+/**
+ * @brief resolves the enabled entries of a snapshot to SOPs, cooks them and removes the filtered
+ * attributes and groups, then works out the transform and paths of each source.
+ * Sources which failed to cook are kept, without geometry, so they are reported by the merge.
+ */
+std::vector<MergeSource> gatherSources(const ParmSnapshot& snapshot, MergeHost& host, OP_Context& context,
+                                       MergeStats& stats);
+
+/**
+ * @brief replaces the contents of gdp with the merged sources, in order.
+ * The whole merge is planned before anything is copied. If the parallel merge is asked for, sources are
+ * copied in parallel when they all consist of polygons; otherwise sources which share a cooked detail are
+ * copied once and duplicated. Then the
+ * sources are transformed, tagged with their paths, their materials resolved and the rewrite rules applied.
+ */
+MergeResult mergeSources(GU_Detail& gdp, const std::vector<MergeSource>& sources, const MergeOptions& options,
+                         MergeHost& host, MergeStats& stats);
+
+/**
+ * @brief gathers the sources of a snapshot and merges them into gdp. The SOP runs the two steps itself,
+ * as it may reuse a cached frame or update the previous merge in between.
+ */
+MergeResult mergeObjects(GU_Detail& gdp, const ParmSnapshot& snapshot, MergeHost& host, OP_Context& context,
+                         MergeStats& stats);
+
+/**
+ * @brief replaces the materials of a source's primitives with the materials they resolve to, and gives
+ * primitives without one the material of their object. Paths which can't be resolved are kept.
+ * @param hintpath a hint path returned by MaterialLibrary::resolveHintPath().
+ */
+void resolveMaterials(GU_Detail& gdp, const GA_Range& primrange, OP_Network& objptr, MaterialLibrary& materials,
+                      const UT_StringHolder& hintpath, bool matchnames);
+
+/**
+ * @brief true if every primitive is fully described by its points and vertices.
+ * Such ranges can be recopied and transformed again; primitives which carry their own
+ * transform (packed, quadrics, volumes) would be transformed twice.
+ */
+bool hasOnlyPointTransforms(const GU_Detail& geo);
+
+/** @brief the name of the primitive attribute an indexed path attribute is encoded in. */
+UT_StringHolder indexAttribName(const char* base);
+
+/** @brief true if any rule rewrites the attribute. */
+bool isRewriteTarget(const char* attribname, const std::vector<RewriteRule>& rules);
+
+/**
+ * @brief the node a hierarchy path continues from: the parent transform (input 0) or, at the top of
+ * the transform chain, a containing subnet of the same type.
+ */
+const OP_Node* hierarchyParent(const OP_Node& node, bool resolve_subnets);
+
+/** @brief finds or creates a primitive string attribute. */
+GA_Attribute* primStringAttribute(GU_Detail& geo, const char* name);
+
+/**
+ * @brief sets a string attribute to the same value over a whole range.
+ * The value is added to the string table once, and the range is filled with its handle, so no strings
+ * are built or hashed per element.
+ */
+void fillStringAttribute(GA_Attribute* attr, const GA_Range& range, const char* value);
+
+/** @brief finds or creates the primitive attribute holding path table indices. -1 means no path. */
+GA_Attribute* primIndexAttribute(GU_Detail& geo, const UT_StringHolder& name);
+
+/** @brief sets an int attribute to the same value over a whole range, one page at a time. */
+void fillIndexAttribute(GA_Attribute* attr, const GA_Range& range, int32 value);
+
+/**
+ * @brief rewrites every unique value of a string attribute.
+ * Values are rewritten in parallel, then written back into the string table, so the cost doesn't depend
+ * on the number of elements.
+ */
+void rewriteStrings(GA_Attribute* attr, const CompiledReplace& program);
+
+/**
+ * @brief rewrites the string attributes of every class whose names match a pattern.
+ * @param attribs a list of attribute names and wildcards.
+ */
+void rewriteStringAttributes(GU_Detail& geo, const char* attribs, const CompiledReplace& program);
+
+}
@@ -0,0 +1,372 @@
+#include "ams_mergecore.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+namespace ams {
+namespace core {
+
+const int32_t StringAttribute::NONE;
+
+
+int32_t StringAttribute::add(const std::string& value) {
+  if (value.empty())
+    return NONE;
+  // The table may have been filled directly, e.g. by the HDK adapter.
+  if (myLookup.size() != table.size()) {
+    myLookup.clear();
+    for (size_t i = 0; i < table.size(); i++)
+      myLookup.emplace(table[i], (int32_t) i);
+  }
+  auto found = myLookup.emplace(value, (int32_t) table.size());
+  if (found.second)
+    table.push_back(value);
+  return found.first->second;
+}
+
+
+const std::string& StringAttribute::get(size_t element) const {
+  static const std::string empty;
+  int32_t index = indices[element];
+  return index == NONE ? empty : table[index];
+}
+
+
+Matrix4 Matrix4::identity() {
+  Matrix4 xform;
+  for (int row = 0; row < 4; row++) {
+    for (int col = 0; col < 4; col++)
+      xform.m[row][col] = row == col ? 1.0 : 0.0;
+  }
+  return xform;
+}
+
+
+double Matrix4::determinant3() const {
+  return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+       - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+       + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+
+VectorTransform::VectorTransform(const Matrix4& xform, TypeInfo typeinfo) {
+  // Normals are transformed by the inverse transpose of the 3x3 part, which for row vectors is
+  // the transposed cofactor matrix divided by the determinant. Lengths are restored afterwards,
+  // so the scale of the determinant doesn't matter, only its sign.
+  const auto& x = xform.m;
+  double det = typeinfo == TypeInfo::NORMAL ? xform.determinant3() : 1.0;
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 3; col++) {
+      if (typeinfo == TypeInfo::NORMAL) {
+        int r1 = (row + 1) % 3, r2 = (row + 2) % 3, c1 = (col + 1) % 3, c2 = (col + 2) % 3;
+        double cofactor = x[r1][c1] * x[r2][c2] - x[r1][c2] * x[r2][c1];
+        m[row][col] = det < 0.0 ? -cofactor : cofactor;
+      } else {
+        m[row][col] = x[row][col];
+      }
+    }
+    t[row] = typeinfo == TypeInfo::POINT ? x[3][row] : 0.0;
+  }
+  keeplength = typeinfo == TypeInfo::VECTOR || typeinfo == TypeInfo::NORMAL;
+}
+
+
+size_t Geometry::numElements(Owner owner) const {
+  switch (owner) {
+    case POINT: return numpoints;
+    case VERTEX: return numVertices();
+    case PRIMITIVE: return numPrimitives();
+    default: return 0;
+  }
+}
+
+
+template <class Attribute>
+static Attribute* findByName(std::vector<Attribute>& attribs, const std::string& name) {
+  for (Attribute& attr : attribs) {
+    if (attr.name == name)
+      return &attr;
+  }
+  return nullptr;
+}
+
+
+FloatAttribute* Geometry::findFloat(Owner owner, const std::string& name) {
+  return findByName(floats[owner], name);
+}
+
+
+const FloatAttribute* Geometry::findFloat(Owner owner, const std::string& name) const {
+  return findByName(const_cast<std::vector<FloatAttribute>&>(floats[owner]), name);
+}
+
+
+StringAttribute* Geometry::findString(Owner owner, const std::string& name) {
+  return findByName(strings[owner], name);
+}
+
+
+const StringAttribute* Geometry::findString(Owner owner, const std::string& name) const {
+  return findByName(const_cast<std::vector<StringAttribute>&>(strings[owner]), name);
+}
+
+
+FloatAttribute& Geometry::addFloat(Owner owner, const std::string& name, size_t tuplesize, TypeInfo typeinfo) {
+  if (FloatAttribute* attr = findFloat(owner, name))
+    return *attr;
+  floats[owner].emplace_back();
+  FloatAttribute& attr = floats[owner].back();
+  attr.name = name;
+  attr.typeinfo = typeinfo;
+  attr.components.assign(tuplesize, std::vector<float>(numElements(owner), 0.0f));
+  return attr;
+}
+
+
+StringAttribute& Geometry::addString(Owner owner, const std::string& name) {
+  if (StringAttribute* attr = findString(owner, name))
+    return *attr;
+  strings[owner].emplace_back();
+  StringAttribute& attr = strings[owner].back();
+  attr.name = name;
+  attr.indices.assign(numElements(owner), StringAttribute::NONE);
+  return attr;
+}
+
+
+void Geometry::appendPolygon(const std::vector<int64_t>& points) {
+  vertexpoints.insert(vertexpoints.end(), points.begin(), points.end());
+  primstarts.push_back((int64_t) vertexpoints.size());
+}
+
+
+ElementCounts planRanges(const std::vector<ElementCounts>& sources, std::vector<SourceRanges>& ranges) {
+  ElementCounts total;
+  ranges.clear();
+  ranges.reserve(sources.size());
+  for (const ElementCounts& counts : sources) {
+    SourceRanges source;
+    source.points = {total.points, counts.points};
+    source.vertices = {total.vertices, counts.vertices};
+    source.prims = {total.prims, counts.prims};
+    ranges.push_back(source);
+    total.points += counts.points;
+    total.vertices += counts.vertices;
+    total.prims += counts.prims;
+  }
+  return total;
+}
+
+
+MergePlan planMerge(const std::vector<const Geometry*>& sources) {
+  MergePlan plan;
+  std::vector<ElementCounts> counts;
+  for (const Geometry* source : sources)
+    counts.push_back({source->numpoints, source->numVertices(), source->numPrimitives()});
+  ElementCounts total = planRanges(counts, plan.ranges);
+  plan.numpoints = total.points;
+  plan.numvertices = total.vertices;
+  plan.numprims = total.prims;
+
+  // The first source to have an attribute defines it, like attributes cloned from the first detail.
+  for (int owner = 0; owner < OWNER_N; owner++) {
+    for (const Geometry* source : sources) {
+      for (const FloatAttribute& attr : source->floats[owner]) {
+        if (findByName(plan.floats[owner], attr.name))
+          continue;
+        FloatAttribute schema;
+        schema.name = attr.name;
+        schema.typeinfo = attr.typeinfo;
+        schema.components.resize(attr.tupleSize());
+        schema.defaults = attr.defaults;
+        plan.floats[owner].push_back(schema);
+      }
+    }
+    // String tables are merged up front, so copying a source only maps its indices.
+    auto& remaps = plan.stringremaps[owner];
+    remaps.resize(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+      for (const StringAttribute& attr : sources[i]->strings[owner]) {
+        StringAttribute* merged = findByName(plan.strings[owner], attr.name);
+        if (!merged) {
+          plan.strings[owner].emplace_back();
+          merged = &plan.strings[owner].back();
+          merged->name = attr.name;
+        }
+        size_t index = merged - plan.strings[owner].data();
+        if (remaps[i].size() <= index)
+          remaps[i].resize(index + 1);
+        std::vector<int32_t>& remap = remaps[i][index];
+        remap.resize(attr.table.size());
+        for (size_t j = 0; j < attr.table.size(); j++)
+          remap[j] = merged->add(attr.table[j]);
+      }
+    }
+    for (auto& remap : remaps)
+      remap.resize(plan.strings[owner].size());
+  }
+  return plan;
+}
+
+
+void allocateMerge(Geometry& dest, const MergePlan& plan) {
+  dest.numpoints = plan.numpoints;
+  dest.vertexpoints.assign(plan.numvertices, 0);
+  dest.primstarts.assign(plan.numprims + 1, 0);
+  dest.primstarts[plan.numprims] = (int64_t) plan.numvertices;
+  for (int owner = 0; owner < OWNER_N; owner++) {
+    size_t count = dest.numElements((Owner) owner);
+    dest.floats[owner] = plan.floats[owner];
+    for (FloatAttribute& attr : dest.floats[owner]) {
+      for (size_t c = 0; c < attr.tupleSize(); c++)
+        attr.components[c].assign(count, attr.defaultValue(c));
+    }
+    dest.strings[owner] = plan.strings[owner];
+    for (StringAttribute& attr : dest.strings[owner])
+      attr.indices.assign(count, StringAttribute::NONE);
+  }
+}
+
+
+void copySource(Geometry& dest, const Geometry& source, size_t index, const MergePlan& plan) {
+  const SourceRanges& ranges = plan.ranges[index];
+  for (size_t v = 0; v < ranges.vertices.size; v++)
+    dest.vertexpoints[ranges.vertices.start + v] = source.vertexpoints[v] + (int64_t) ranges.points.start;
+  for (size_t p = 0; p < ranges.prims.size; p++)
+    dest.primstarts[ranges.prims.start + p] = source.primstarts[p] + (int64_t) ranges.vertices.start;
+
+  const Range* owners[OWNER_N] = {&ranges.points, &ranges.vertices, &ranges.prims};
+  for (int owner = 0; owner < OWNER_N; owner++) {
+    size_t start = owners[owner]->start;
+    for (const FloatAttribute& attr : source.floats[owner]) {
+      FloatAttribute* merged = findByName(dest.floats[owner], attr.name);
+      size_t tuplesize = std::min(merged->tupleSize(), attr.tupleSize());
+      for (size_t c = 0; c < tuplesize; c++)
+        std::copy(attr.components[c].begin(), attr.components[c].end(), merged->components[c].begin() + start);
+    }
+    for (size_t j = 0; j < dest.strings[owner].size(); j++) {
+      StringAttribute& merged = dest.strings[owner][j];
+      const StringAttribute* attr = source.findString((Owner) owner, merged.name);
+      if (!attr)
+        continue;
+      const std::vector<int32_t>& remap = plan.stringremaps[owner][index][j];
+      for (size_t e = 0; e < attr->indices.size(); e++) {
+        int32_t value = attr->indices[e];
+        merged.indices[start + e] = value == StringAttribute::NONE ? StringAttribute::NONE : remap[value];
+      }
+    }
+  }
+}
+
+
+MergePlan mergeGeometry(Geometry& dest, const std::vector<const Geometry*>& sources, bool parallel) {
+  MergePlan plan = planMerge(sources);
+  allocateMerge(dest, plan);
+  if (parallel) {
+    parallelFor(sources.size(), 1, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+        copySource(dest, *sources[i], i, plan);
+    });
+  } else {
+    for (size_t i = 0; i < sources.size(); i++)
+      copySource(dest, *sources[i], i, plan);
+  }
+  return plan;
+}
+
+
+// Transforms the 3-float tuples of one attribute over a range.
+static void transformAttribute(FloatAttribute& attr, const Range& range, const Matrix4& xform, bool parallel) {
+  if (attr.typeinfo == TypeInfo::NONE || attr.tupleSize() < 3)
+    return;
+  float* x = attr.components[0].data() + range.start;
+  float* y = attr.components[1].data() + range.start;
+  float* z = attr.components[2].data() + range.start;
+  VectorTransform vectorxform(xform, attr.typeinfo);
+  auto body = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+      vectorxform.apply(x[i], y[i], z[i]);
+  };
+  if (parallel)
+    parallelFor(range.size, 4096, body);
+  else
+    body(0, range.size);
+}
+
+
+// Reverses the vertex order of the polygons in a range, keeping the first vertex of each,
+// like closed polygons are reversed in Houdini.
+static void reversePolygons(Geometry& geo, const Range& prims) {
+  for (size_t p = prims.start; p < prims.start + prims.size; p++) {
+    int64_t begin = geo.primstarts[p] + 1;
+    int64_t end = geo.primstarts[p + 1];
+    if (end - begin < 2)
+      continue;
+    std::reverse(geo.vertexpoints.begin() + begin, geo.vertexpoints.begin() + end);
+    for (FloatAttribute& attr : geo.floats[VERTEX]) {
+      for (auto& component : attr.components)
+        std::reverse(component.begin() + begin, component.begin() + end);
+    }
+    for (StringAttribute& attr : geo.strings[VERTEX])
+      std::reverse(attr.indices.begin() + begin, attr.indices.begin() + end);
+  }
+}
+
+
+void transformRanges(Geometry& geo, const SourceRanges& ranges, const Matrix4& xform, bool parallel) {
+  const Range* owners[OWNER_N] = {&ranges.points, &ranges.vertices, &ranges.prims};
+  for (int owner = 0; owner < OWNER_N; owner++) {
+    for (FloatAttribute& attr : geo.floats[owner])
+      transformAttribute(attr, *owners[owner], xform, parallel);
+  }
+  if (xform.determinant3() < 0.0)
+    reversePolygons(geo, ranges.prims);
+}
+
+
+void tagStrings(Geometry& geo, Owner owner, const std::string& name, const Range& range, const std::string& value) {
+  StringAttribute& attr = geo.addString(owner, name);
+  int32_t index = attr.add(value);
+  std::fill(attr.indices.begin() + range.start, attr.indices.begin() + range.start + range.size, index);
+}
+
+
+void remapStrings(StringAttribute& attr, const Range& range,
+                  const std::function<std::string(const std::string&)>& resolve) {
+  // Resolved strings are added after the strings already in the table, so the indices being
+  // remapped keep pointing at their original strings.
+  auto remap = makeIndexRemap([&](int64_t index) -> int64_t {
+    std::string value = index == StringAttribute::NONE ? std::string() : attr.table[index];
+    return attr.add(resolve(value));
+  });
+  for (size_t e = range.start; e < range.start + range.size; e++)
+    attr.indices[e] = (int32_t) remap(attr.indices[e]);
+}
+
+
+void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body) {
+  grain = std::max(grain, (size_t) 1);
+  size_t chunks = (count + grain - 1) / grain;
+  size_t threads = std::min((size_t) std::max(std::thread::hardware_concurrency(), 1u), chunks);
+  if (threads <= 1) {
+    if (count > 0)
+      body(0, count);
+    return;
+  }
+  // Threads take the next chunk when they finish one, so uneven chunks balance out.
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t chunk = next++; chunk < chunks; chunk = next++)
+      body(chunk * grain, std::min((chunk + 1) * grain, count));
+  };
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads; i++)
+    pool.emplace_back(worker);
+  worker();
+  for (std::thread& thread : pool)
+    thread.join();
+}
+
+}
+}
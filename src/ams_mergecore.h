@@ -0,0 +1,259 @@
+// The merge algorithm of the object merge, on a plain struct-of-arrays polygon container. Nothing here
+// depends on Houdini, so the merge can be run, tested and profiled headless with synthetic geometry.
+// ams_mergecore_hdk.h converts between this container and GU_Detail.
+
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace ams {
+namespace core {
+
+/** @brief the element classes attributes can belong to. */
+enum Owner {
+  POINT = 0,
+  VERTEX,
+  PRIMITIVE,
+  OWNER_N
+};
+
+/** @brief how a float attribute transforms. Matches the type info of Houdini attributes. */
+enum class TypeInfo {
+  NONE,
+  /** @brief a position, which is translated. */
+  POINT,
+  /** @brief a direction, which is rotated and scaled, keeping its length. */
+  VECTOR,
+  /** @brief a normal, which is transformed by the inverse transpose and keeps its length. */
+  NORMAL
+};
+
+/** @brief a float attribute, stored as one array per tuple component. */
+struct FloatAttribute {
+  std::string name;
+  TypeInfo typeinfo = TypeInfo::NONE;
+  std::vector<std::vector<float>> components;
+  /** @brief the value of elements merged from sources without the attribute, per component. Zero if missing. */
+  std::vector<float> defaults;
+
+  size_t tupleSize() const { return components.size(); }
+  float defaultValue(size_t component) const { return component < defaults.size() ? defaults[component] : 0.0f; }
+};
+
+/** @brief a string attribute: a table of unique strings, and an index into it per element. */
+struct StringAttribute {
+  /** @brief the index of elements which hold no string. */
+  static const int32_t NONE = -1;
+
+  std::string name;
+  std::vector<std::string> table;
+  std::vector<int32_t> indices;
+
+  /** @brief the index of a string in the table, adding it if it isn't there yet. The empty string is NONE. */
+  int32_t add(const std::string& value);
+  /** @brief the string of an element. Empty if it holds none. */
+  const std::string& get(size_t element) const;
+
+private:
+  std::unordered_map<std::string, int32_t> myLookup;
+};
+
+/** @brief a 4x4 matrix applied to row vectors, like UT_Matrix4D: translation is in the last row. */
+struct Matrix4 {
+  double m[4][4];
+
+  static Matrix4 identity();
+  double determinant3() const;
+};
+
+/**
+ * @brief a matrix prepared for transforming one kind of 3-vector, so it is set up once per attribute
+ * rather than once per element. Positions are translated. Vectors and normals keep their lengths, as they
+ * do with GEO_Detail::transform, and normals are transformed by the inverse transpose.
+ */
+struct VectorTransform {
+  double m[3][3];
+  double t[3];
+  bool keeplength;
+
+  VectorTransform(const Matrix4& xform, TypeInfo typeinfo);
+
+  template <class T>
+  void apply(T& x, T& y, T& z) const {
+    double rx = x * m[0][0] + y * m[1][0] + z * m[2][0] + t[0];
+    double ry = x * m[0][1] + y * m[1][1] + z * m[2][1] + t[1];
+    double rz = x * m[0][2] + y * m[1][2] + z * m[2][2] + t[2];
+    if (keeplength) {
+      double length2 = (double) x * x + (double) y * y + (double) z * z;
+      double newlength2 = rx * rx + ry * ry + rz * rz;
+      if (newlength2 > 0.0) {
+        double scale = std::sqrt(length2 / newlength2);
+        rx *= scale;
+        ry *= scale;
+        rz *= scale;
+      }
+    }
+    x = (T) rx;
+    y = (T) ry;
+    z = (T) rz;
+  }
+};
+
+/** @brief transforms count 3-vectors stored one after the other, like the pages of a Houdini attribute. */
+template <class T>
+void transformPacked(T* data, size_t count, const VectorTransform& xform) {
+  for (size_t i = 0; i < count; i++, data += 3)
+    xform.apply(data[0], data[1], data[2]);
+}
+
+/**
+ * @brief maps string table indices through resolve, calling it once per distinct index.
+ * Negative indices are elements without a string, and are resolved as the index -1.
+ */
+template <class Resolve>
+class IndexRemap {
+public:
+  explicit IndexRemap(Resolve resolve) : myResolve(std::move(resolve)) {}
+
+  int64_t operator()(int64_t index) {
+    size_t slot = index < 0 ? 0 : (size_t) index + 1;
+    if (slot >= myMapped.size())
+      myMapped.resize(slot + 1, UNRESOLVED);
+    if (myMapped[slot] == UNRESOLVED)
+      myMapped[slot] = myResolve(index < 0 ? -1 : index);
+    return myMapped[slot];
+  }
+
+private:
+  static constexpr int64_t UNRESOLVED = INT64_MIN;
+  Resolve myResolve;
+  std::vector<int64_t> myMapped;
+};
+
+template <class Resolve>
+constexpr int64_t IndexRemap<Resolve>::UNRESOLVED;
+
+template <class Resolve>
+IndexRemap<Resolve> makeIndexRemap(Resolve resolve) {
+  return IndexRemap<Resolve>(std::move(resolve));
+}
+
+/** @brief polygons, their vertices and points, and float and string attributes of each element class. */
+struct Geometry {
+  size_t numpoints = 0;
+  /** @brief the point of each vertex. */
+  std::vector<int64_t> vertexpoints;
+  /** @brief the first vertex of each polygon, followed by the number of vertices. */
+  std::vector<int64_t> primstarts{0};
+  std::vector<FloatAttribute> floats[OWNER_N];
+  std::vector<StringAttribute> strings[OWNER_N];
+
+  size_t numVertices() const { return vertexpoints.size(); }
+  size_t numPrimitives() const { return primstarts.size() - 1; }
+  size_t numElements(Owner owner) const;
+
+  FloatAttribute* findFloat(Owner owner, const std::string& name);
+  const FloatAttribute* findFloat(Owner owner, const std::string& name) const;
+  StringAttribute* findString(Owner owner, const std::string& name);
+  const StringAttribute* findString(Owner owner, const std::string& name) const;
+  // Adding an attribute may move the other attributes of its class, so earlier references must be found again.
+  /** @brief finds or creates a float attribute, zero for every element. */
+  FloatAttribute& addFloat(Owner owner, const std::string& name, size_t tuplesize, TypeInfo typeinfo = TypeInfo::NONE);
+  /** @brief finds or creates a string attribute, with every element holding no string. */
+  StringAttribute& addString(Owner owner, const std::string& name);
+
+  /**
+   * @brief appends a polygon of existing points.
+   * Attributes are not resized, so the topology is built before attributes are added.
+   */
+  void appendPolygon(const std::vector<int64_t>& points);
+};
+
+/** @brief the number of points, vertices and primitives of a source. */
+struct ElementCounts {
+  size_t points = 0;
+  size_t vertices = 0;
+  size_t prims = 0;
+};
+
+/** @brief a contiguous range of elements. */
+struct Range {
+  size_t start = 0;
+  size_t size = 0;
+};
+
+/** @brief the ranges of one source in the merged geometry. */
+struct SourceRanges {
+  Range points;
+  Range vertices;
+  Range prims;
+};
+
+/**
+ * @brief where each source goes in the merged geometry, and the union of their attributes.
+ * Every source writes only to its own ranges, so sources can be copied concurrently.
+ */
+struct MergePlan {
+  std::vector<SourceRanges> ranges;
+  size_t numpoints = 0;
+  size_t numvertices = 0;
+  size_t numprims = 0;
+  /**
+   * @brief the attributes of the merged geometry, without data. Missing attributes take the defaults of
+   * the first source to have them, or hold no string.
+   */
+  std::vector<FloatAttribute> floats[OWNER_N];
+  std::vector<StringAttribute> strings[OWNER_N];
+  /** @brief per source and string attribute, the merged index of each index of the source table. */
+  std::vector<std::vector<std::vector<int32_t>>> stringremaps[OWNER_N];
+};
+
+/**
+ * @brief allocates every source its ranges, in order.
+ * @return the total number of points, vertices and primitives.
+ */
+ElementCounts planRanges(const std::vector<ElementCounts>& sources, std::vector<SourceRanges>& ranges);
+
+/** @brief allocates every source its ranges, in order, and builds the union of their attributes and string tables. */
+MergePlan planMerge(const std::vector<const Geometry*>& sources);
+
+/** @brief sizes the merged geometry and creates its attributes. Previous contents are discarded. */
+void allocateMerge(Geometry& dest, const MergePlan& plan);
+
+/** @brief copies one source into its ranges of an allocated geometry. */
+void copySource(Geometry& dest, const Geometry& source, size_t index, const MergePlan& plan);
+
+/**
+ * @brief merges sources in order: plans, allocates and copies them.
+ * @param parallel copy sources concurrently.
+ */
+MergePlan mergeGeometry(Geometry& dest, const std::vector<const Geometry*>& sources, bool parallel);
+
+/**
+ * @brief transforms the points, vertices and primitives of a source's ranges by a matrix, as VectorTransform
+ * does. A negative determinant also reverses the polygons, as Houdini does with closed polygons.
+ */
+void transformRanges(Geometry& geo, const SourceRanges& ranges, const Matrix4& xform, bool parallel);
+
+/** @brief sets a string attribute to the same value over a range, creating the attribute if needed. */
+void tagStrings(Geometry& geo, Owner owner, const std::string& name, const Range& range, const std::string& value);
+
+/**
+ * @brief replaces the strings of a range, e.g. material paths with the materials they resolve to.
+ * Each distinct string in the range is resolved once. Elements without a string are resolved from the empty
+ * string, and resolving to the empty string clears the element.
+ */
+void remapStrings(StringAttribute& attr, const Range& range,
+                  const std::function<std::string(const std::string&)>& resolve);
+
+/** @brief calls body(begin, end) over subranges of [0, count) on several threads. */
+void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+}
+}
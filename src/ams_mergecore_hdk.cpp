@@ -0,0 +1,161 @@
+#include "ams_mergecore_hdk.h"
+#include <GA/GA_ATINumeric.h>
+#include <GA/GA_Defaults.h>
+#include <GA/GA_Handle.h>
+#include <GA/GA_Iterator.h>
+#include <GA/GA_PolyCounts.h>
+#include <GA/GA_PrimitiveTypes.h>
+#include <GEO/GEO_PrimPoly.h>
+#include <vector>
+
+namespace ams {
+
+static const GA_AttributeOwner theOwners[core::OWNER_N] = {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE};
+
+
+core::TypeInfo toCoreTypeInfo(GA_TypeInfo typeinfo) {
+  switch (typeinfo) {
+    case GA_TYPE_POINT:
+    case GA_TYPE_HPOINT:
+      return core::TypeInfo::POINT;
+    case GA_TYPE_VECTOR:
+      return core::TypeInfo::VECTOR;
+    case GA_TYPE_NORMAL:
+      return core::TypeInfo::NORMAL;
+    default:
+      return core::TypeInfo::NONE;
+  }
+}
+
+
+static GA_TypeInfo fromCoreTypeInfo(core::TypeInfo typeinfo) {
+  switch (typeinfo) {
+    case core::TypeInfo::POINT:
+      return GA_TYPE_POINT;
+    case core::TypeInfo::VECTOR:
+      return GA_TYPE_VECTOR;
+    case core::TypeInfo::NORMAL:
+      return GA_TYPE_NORMAL;
+    default:
+      return GA_TYPE_VOID;
+  }
+}
+
+
+bool toCoreGeometry(const GU_Detail& geo, core::Geometry& result) {
+  result = core::Geometry();
+  // The offsets of each element class, in the order the core stores them.
+  std::vector<GA_Offset> offsets[core::OWNER_N];
+  for (GA_Iterator it(geo.getPointRange()); !it.atEnd(); ++it)
+    offsets[core::POINT].push_back(*it);
+  for (GA_Iterator it(geo.getPrimitiveRange()); !it.atEnd(); ++it) {
+    const GA_Primitive* prim = geo.getPrimitive(*it);
+    // Open polygons reverse differently, so they are not merged by the core.
+    if (prim->getTypeId() != GA_PRIMPOLY || !static_cast<const GEO_PrimPoly*>(prim)->isClosed())
+      return false;
+    offsets[core::PRIMITIVE].push_back(*it);
+    for (GA_Size v = 0; v < prim->getVertexCount(); v++) {
+      offsets[core::VERTEX].push_back(prim->getVertexOffset(v));
+      result.vertexpoints.push_back((int64_t) geo.pointIndex(prim->getPointOffset(v)));
+    }
+    result.primstarts.push_back((int64_t) result.vertexpoints.size());
+  }
+  result.numpoints = offsets[core::POINT].size();
+
+  for (int owner = 0; owner < core::OWNER_N; owner++) {
+    const std::vector<GA_Offset>& elements = offsets[owner];
+    for (auto it = geo.getAttributeDict(theOwners[owner]).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+      const GA_Attribute* attr = it.attrib();
+      GA_ROHandleF floats(attr);
+      GA_ROHandleS strings(attr);
+      if (floats.isValid()) {
+        core::FloatAttribute& coreattr = result.addFloat((core::Owner) owner, attr->getName().toStdString(),
+                                                         floats.getTupleSize(), toCoreTypeInfo(attr->getTypeInfo()));
+        if (const GA_ATINumeric* numeric = GA_ATINumeric::cast(attr)) {
+          for (int c = 0; c < floats.getTupleSize(); c++) {
+            fpreal32 value;
+            numeric->getDefaults().get(c, value);
+            coreattr.defaults.push_back(value);
+          }
+        }
+        for (int c = 0; c < floats.getTupleSize(); c++) {
+          for (size_t i = 0; i < elements.size(); i++)
+            coreattr.components[c][i] = floats.get(elements[i], c);
+        }
+      } else if (strings.isValid()) {
+        core::StringAttribute& coreattr = result.addString((core::Owner) owner, attr->getName().toStdString());
+        for (size_t i = 0; i < elements.size(); i++)
+          coreattr.indices[i] = coreattr.add(strings.get(elements[i]).toStdString());
+      }
+    }
+  }
+  return true;
+}
+
+
+void fromCoreGeometry(const core::Geometry& geo, GU_Detail& result) {
+  result.clearAndDestroy();
+  GA_Offset ptstart = result.appendPointBlock((GA_Size) geo.numpoints);
+  GA_PolyCounts counts;
+  for (size_t p = 0; p < geo.numPrimitives(); p++)
+    counts.append(geo.primstarts[p + 1] - geo.primstarts[p]);
+  std::vector<int> pointnumbers(geo.vertexpoints.begin(), geo.vertexpoints.end());
+  GA_Offset primstart = GEO_PrimPoly::buildBlock(&result, ptstart, (GA_Size) geo.numpoints, counts,
+                                                 pointnumbers.data(), true);
+
+  std::vector<GA_Offset> offsets[core::OWNER_N];
+  for (size_t i = 0; i < geo.numpoints; i++)
+    offsets[core::POINT].push_back(ptstart + (GA_Offset) i);
+  for (size_t p = 0; p < geo.numPrimitives(); p++) {
+    GA_Offset primoff = primstart + (GA_Offset) p;
+    offsets[core::PRIMITIVE].push_back(primoff);
+    const GA_Primitive* prim = result.getPrimitive(primoff);
+    for (GA_Size v = 0; v < prim->getVertexCount(); v++)
+      offsets[core::VERTEX].push_back(prim->getVertexOffset(v));
+  }
+
+  for (int owner = 0; owner < core::OWNER_N; owner++) {
+    const std::vector<GA_Offset>& elements = offsets[owner];
+    for (const core::FloatAttribute& coreattr : geo.floats[owner]) {
+      GA_Attribute* attr = result.findAttribute(theOwners[owner], coreattr.name.c_str());
+      if (!attr) {
+        std::vector<fpreal32> defaults;
+        for (size_t c = 0; c < coreattr.tupleSize(); c++)
+          defaults.push_back(coreattr.defaultValue(c));
+        attr = result.addFloatTuple(theOwners[owner], coreattr.name.c_str(), (int) coreattr.tupleSize(),
+                                    GA_Defaults(defaults.data(), (int) defaults.size()));
+      }
+      attr->setTypeInfo(fromCoreTypeInfo(coreattr.typeinfo));
+      GA_RWHandleF handle(attr);
+      if (!handle.isValid())
+        continue;
+      int tuplesize = SYSmin(handle.getTupleSize(), (int) coreattr.tupleSize());
+      for (int c = 0; c < tuplesize; c++) {
+        for (size_t i = 0; i < elements.size(); i++)
+          handle.set(elements[i], c, coreattr.components[c][i]);
+      }
+    }
+    for (const core::StringAttribute& coreattr : geo.strings[owner]) {
+      GA_RWHandleS handle(result.addStringTuple(theOwners[owner], coreattr.name.c_str(), 1));
+      if (!handle.isValid())
+        continue;
+      for (size_t i = 0; i < elements.size(); i++) {
+        if (coreattr.indices[i] != core::StringAttribute::NONE)
+          handle.set(elements[i], UT_StringHolder(coreattr.table[coreattr.indices[i]]));
+      }
+    }
+  }
+  result.bumpAllDataIds();
+}
+
+
+core::Matrix4 toCoreMatrix(const UT_Matrix4D& xform) {
+  core::Matrix4 result;
+  for (int row = 0; row < 4; row++) {
+    for (int col = 0; col < 4; col++)
+      result.m[row][col] = xform(row, col);
+  }
+  return result;
+}
+
+}
@@ -0,0 +1,29 @@
+// Converts between GU_Detail and the merge core container, so real geometry can be fed to the
+// headless merge core, and its results inspected in Houdini. The object merge SOP uses the matrix and
+// type info conversions to run the core's transform kernel over the pages of its attributes.
+
+#pragma once
+#include "ams_mergecore.h"
+#include <GU/GU_Detail.h>
+#include <UT/UT_Matrix4.h>
+
+
+namespace ams {
+
+/**
+ * @brief copies the polygons, float attributes and string attributes of a detail into a core geometry.
+ * Points, vertices and primitives are stored in index order; vertices in the order of their polygons.
+ * Float attributes keep their defaults.
+ * @return false if the detail holds primitives other than closed polygons.
+ */
+bool toCoreGeometry(const GU_Detail& geo, core::Geometry& result);
+
+/** @brief replaces the contents of a detail with a core geometry, as closed polygons. */
+void fromCoreGeometry(const core::Geometry& geo, GU_Detail& result);
+
+core::Matrix4 toCoreMatrix(const UT_Matrix4D& xform);
+
+/** @brief how the core transforms an attribute of the given type info. */
+core::TypeInfo toCoreTypeInfo(GA_TypeInfo typeinfo);
+
+}
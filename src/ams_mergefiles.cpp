@@ -0,0 +1,304 @@
+#include "ams_mergefiles.h"
+#include <UT/UT_ParallelUtil.h>
+#include <UT/UT_WorkBuffer.h>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <sstream>
+
+
+namespace ams {
+
+std::string expandFrame(const std::string& pattern, int frame) {
+  std::string result;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] != '$' || i + 1 >= pattern.size() || pattern[i + 1] != 'F') {
+      result += pattern[i];
+      continue;
+    }
+    size_t digits = i + 2;
+    while (digits < pattern.size() && isdigit((unsigned char) pattern[digits]))
+      digits++;
+    int padding = digits > i + 2 ? atoi(pattern.substr(i + 2, digits - i - 2).c_str()) : 0;
+    UT_WorkBuffer number;
+    number.sprintf("%0*d", padding, frame);
+    result += number.buffer();
+    i = digits - 1;
+  }
+  return result;
+}
+
+
+std::string defaultPath(const std::string& file) {
+  size_t slash = file.find_last_of("/\\");
+  std::string name = slash == std::string::npos ? file : file.substr(slash + 1);
+  return name.substr(0, name.find('.'));
+}
+
+
+bool parseMatrix(const char* str, UT_Matrix4D& xform) {
+  std::stringstream stream(str);
+  std::string value;
+  int count = 0;
+  while (std::getline(stream, value, ',')) {
+    if (count >= 16)
+      return false;
+    char* end = nullptr;
+    xform(count / 4, count % 4) = strtod(value.c_str(), &end);
+    if (end == value.c_str())
+      return false;
+    count++;
+  }
+  return count == 16;
+}
+
+
+// Only accepts arguments which are whole numbers, so a file name is never read as one.
+static bool parseInt(const char* str, int& value) {
+  char* end = nullptr;
+  long parsed = strtol(str, &end, 10);
+  if (end == str || *end != '\0')
+    return false;
+  value = (int) parsed;
+  return true;
+}
+
+
+void printUsage() {
+  std::cerr << "Usage: hams_merge [options] -o OUTPUT INPUT [--path PATH] [--xform M00,...,M33] [INPUT ...]\n"
+               "Options: --frames START END, --step N, --threads N, --pathattrib NAME, --nodepathattrib NAME,\n"
+               "         --rule ATTRIBS PATTERN REPLACE, --verbose" << std::endl;
+}
+
+
+bool parseArgs(int argc, const char* const argv[], MergeConfig& config) {
+  auto needs = [&](int i, int count) {
+    if (i + count < argc)
+      return true;
+    std::cerr << argv[i] << " expects " << count << " argument(s)." << std::endl;
+    return false;
+  };
+  auto needsNumbers = [&](int i, int count, int* values[]) {
+    if (!needs(i, count))
+      return false;
+    for (int n = 0; n < count; n++) {
+      if (!parseInt(argv[i + 1 + n], *values[n])) {
+        std::cerr << argv[i] << " expects " << count << " whole number(s)." << std::endl;
+        return false;
+      }
+    }
+    return true;
+  };
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (!strcmp(arg, "-o") || !strcmp(arg, "--output")) {
+      if (!needs(i, 1)) return false;
+      config.output = argv[++i];
+    } else if (!strcmp(arg, "-f") || !strcmp(arg, "--frames")) {
+      int* range[] = {&config.start, &config.end};
+      if (!needsNumbers(i, 2, range)) return false;
+      i += 2;
+    } else if (!strcmp(arg, "--step")) {
+      int* step[] = {&config.step};
+      if (!needsNumbers(i, 1, step)) return false;
+      i++;
+    } else if (!strcmp(arg, "-j") || !strcmp(arg, "--threads")) {
+      int* threads[] = {&config.threads};
+      if (!needsNumbers(i, 1, threads)) return false;
+      i++;
+    } else if (!strcmp(arg, "--pathattrib")) {
+      if (!needs(i, 1)) return false;
+      config.pathattrib = argv[++i];
+    } else if (!strcmp(arg, "--nodepathattrib")) {
+      if (!needs(i, 1)) return false;
+      config.nodepathattrib = argv[++i];
+    } else if (!strcmp(arg, "--rule")) {
+      if (!needs(i, 3)) return false;
+      const char* attribs = argv[++i];
+      const char* pattern = argv[++i];
+      const char* replace = argv[++i];
+      try {
+        config.rules.push_back({UT_StringHolder(attribs), std::make_shared<CompiledReplace>(pattern, replace)});
+      } catch (const std::regex_error& e) {
+        std::cerr << "Invalid rewrite pattern '" << pattern << "': " << e.what() << std::endl;
+        return false;
+      }
+    } else if (!strcmp(arg, "-v") || !strcmp(arg, "--verbose")) {
+      config.verbose = true;
+    } else if (!strcmp(arg, "--path") || !strcmp(arg, "--xform")) {
+      if (!needs(i, 1)) return false;
+      if (config.inputs.empty()) {
+        std::cerr << arg << " must follow the input it applies to." << std::endl;
+        return false;
+      }
+      MergeInput& input = config.inputs.back();
+      if (!strcmp(arg, "--path")) {
+        input.path = argv[++i];
+      } else if (parseMatrix(argv[++i], input.xform)) {
+        input.transform = true;
+      } else {
+        std::cerr << "--xform expects 16 comma separated numbers." << std::endl;
+        return false;
+      }
+    } else if (arg[0] == '-' && arg[1] != '\0') {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return false;
+    } else {
+      MergeInput input;
+      input.file = arg;
+      input.path = defaultPath(input.file);
+      config.inputs.push_back(input);
+    }
+  }
+  if (config.output.empty() || config.inputs.empty()) {
+    std::cerr << "An output and at least one input are required." << std::endl;
+    return false;
+  }
+  if (config.step <= 0 || config.end < config.start) {
+    std::cerr << "Invalid frame range." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+// Joins messages into one line, e.g. for the error of a frame.
+static std::string joinMessages(const std::vector<std::string>& messages) {
+  std::string joined;
+  for (const std::string& message : messages)
+    joined += (joined.empty() ? "" : "; ") + message;
+  return joined;
+}
+
+
+// Merges files outside of any cook, collecting what the merge reports for the caller to print.
+// An input which couldn't be merged is an error rather than a warning, as the output would be incomplete.
+class FileMergeHost : public MergeHost {
+public:
+  OP_Node* node() override { return nullptr; }
+
+  std::vector<OP_Node*> entryNodes(const ObjectEntry& entry) override { return {}; }
+
+  void addDependency(OP_Node* node, OP_InterestType type) override {}
+
+  void addWarning(SOP_ErrorCodes code, const char* msg) override {
+    if (code == SOP_BAD_SOP_MERGED)
+      addError(code, msg);
+    else
+      myWarnings.push_back(describe(code, msg));
+  }
+
+  void addError(SOP_ErrorCodes code, const char* msg) override { myErrors.push_back(describe(code, msg)); }
+
+  void addTransformError(const OP_Node& node, const char* label) override {}
+
+  // Files have no objects, so neither cache is ever filled.
+  HierarchyPaths& hierarchyPaths() override { return myHierPaths; }
+
+  MaterialLibrary& materials() override { return myMaterials; }
+
+  const std::vector<std::string>& warnings() const { return myWarnings; }
+
+  const std::vector<std::string>& errors() const { return myErrors; }
+
+private:
+  static std::string describe(SOP_ErrorCodes code, const char* msg) {
+    std::string detail = msg && *msg ? msg : "";
+    switch (code) {
+      case SOP_BAD_SOP_MERGED:
+        return "Unable to merge " + detail;
+      case SOP_ATTRIBUTE_INVALID:
+        return "Invalid attribute name " + detail;
+      default:
+        return "SOP error " + std::to_string((int) code) + (detail.empty() ? "" : ": " + detail);
+    }
+  }
+
+  std::vector<std::string> myWarnings;
+  std::vector<std::string> myErrors;
+  HierarchyPaths myHierPaths;
+  MaterialLibrary myMaterials;
+};
+
+
+std::string mergeDetails(GU_Detail& merged, const MergeConfig& config, const std::vector<GU_ConstDetailHandle>& details,
+                         int frame, std::vector<std::string>& warnings) {
+  if (details.size() != config.inputs.size())
+    return "Expected one detail per input";
+  // Each file becomes a source without a node, tagged with its path and its expanded file name.
+  std::vector<MergeSource> sources;
+  sources.reserve(details.size());
+  for (size_t i = 0; i < details.size(); i++) {
+    const MergeInput& input = config.inputs[i];
+    MergeSource source;
+    source.objindex = (int) i + 1;
+    source.soppath = expandFrame(input.file, frame);
+    source.sopptr = nullptr;
+    source.objptr = nullptr;
+    source.cookedgdh = details[i];
+    source.cookedgdp = details[i].gdp();
+    source.sourcegdh = details[i];
+    source.sourcegdp = source.cookedgdp;
+    source.cookedid = source.cookedgdp ? source.cookedgdp->getUniqueId() : -1;
+    source.cooktime = 0.0;
+    source.xform = input.xform;
+    source.transformed = input.transform;
+    source.hierpath = input.path;
+    source.nodepath = source.soppath;
+    sources.push_back(source);
+  }
+
+  MergeOptions options;
+  options.mergeparallel = true;
+  options.enablepathattrib = !config.pathattrib.empty();
+  options.pathattrib = config.pathattrib;
+  options.enablenodepathattrib = !config.nodepathattrib.empty();
+  options.nodepathattrib = config.nodepathattrib;
+  options.rules = config.rules;
+
+  FileMergeHost host;
+  MergeStats stats;
+  mergeSources(merged, sources, options, host, stats);
+  warnings.insert(warnings.end(), host.warnings().begin(), host.warnings().end());
+  return joinMessages(host.errors());
+}
+
+
+std::string mergeFrame(const MergeConfig& config, int frame, std::vector<std::string>& warnings) {
+  // Loading is usually the slowest part, and the inputs are independent, so they are loaded together.
+  std::vector<GU_ConstDetailHandle> details(config.inputs.size());
+  std::vector<std::string> loaderrors(config.inputs.size());
+  UTparallelForEachNumber((exint) details.size(), [&](const UT_BlockedRange<exint>& range) {
+    for (exint i = range.begin(); i != range.end(); ++i) {
+      std::string file = expandFrame(config.inputs[i].file, frame);
+      GU_DetailHandle handle;
+      handle.allocateAndSet(new GU_Detail());
+      if (!handle.gdpNC()->load(file.c_str(), nullptr).success())
+        loaderrors[i] = "Unable to load " + file;
+      details[i] = handle;
+    }
+  });
+  std::vector<std::string> errors;
+  for (const std::string& error : loaderrors) {
+    if (!error.empty())
+      errors.push_back(error);
+  }
+  if (!errors.empty())
+    return joinMessages(errors);
+
+  GU_Detail merged;
+  std::string error = mergeDetails(merged, config, details, frame, warnings);
+  if (!error.empty())
+    return error;
+  details.clear();
+
+  std::string output = expandFrame(config.output, frame);
+  if (!merged.save(output.c_str(), nullptr).success())
+    return "Unable to save " + output;
+  return std::string();
+}
+
+}
@@ -0,0 +1,67 @@
+// The merge of geometry files behind hams_merge. Files are merged by mergeSources, the same way the
+// AMS Object Merge merges objects, so the tool and the node produce the same geometry.
+
+#pragma once
+#include "ams_merge.h"
+#include <GU/GU_Detail.h>
+#include <GU/GU_DetailHandle.h>
+#include <UT/UT_Matrix4.h>
+#include <string>
+#include <vector>
+
+
+namespace ams {
+
+/** @brief a file to merge, along with the options which follow it on the command line. */
+struct MergeInput {
+  /** @brief the file name, which may contain frame variables. */
+  std::string file;
+  std::string path;
+  bool transform = false;
+  UT_Matrix4D xform{1.0};
+};
+
+/** @brief the parsed command line of hams_merge. */
+struct MergeConfig {
+  std::vector<MergeInput> inputs;
+  std::string output;
+  int start = 1;
+  int end = 1;
+  int step = 1;
+  int threads = -1;
+  std::string pathattrib = "path";
+  std::string nodepathattrib = "nodepath";
+  std::vector<RewriteRule> rules;
+  bool verbose = false;
+};
+
+
+/** @brief replaces $F and $F<n> with the frame number, padded to n digits. */
+std::string expandFrame(const std::string& pattern, int frame);
+
+/** @brief the file name without its directory and extensions, e.g. /geo/rock.$F4.bgeo.sc -> rock. */
+std::string defaultPath(const std::string& file);
+
+/** @brief parses 16 comma separated numbers into a row-major matrix. */
+bool parseMatrix(const char* str, UT_Matrix4D& xform);
+
+/** @brief returns false, after printing why, if the arguments can't be used. */
+bool parseArgs(int argc, const char* const argv[], MergeConfig& config);
+
+void printUsage();
+
+/**
+ * @brief merges the loaded inputs of a frame into merged, indexed like config.inputs.
+ * Returns an empty string on success, otherwise the errors, e.g. an input which couldn't be merged.
+ * @param warnings receives the warnings of the merge.
+ */
+std::string mergeDetails(GU_Detail& merged, const MergeConfig& config, const std::vector<GU_ConstDetailHandle>& details,
+                         int frame, std::vector<std::string>& warnings);
+
+/**
+ * @brief loads, merges and saves one frame. Returns an empty string on success, otherwise the errors.
+ * @param warnings receives the warnings of the merge.
+ */
+std::string mergeFrame(const MergeConfig& config, int frame, std::vector<std::string>& warnings);
+
+}
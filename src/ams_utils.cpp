@@ -3,6 +3,9 @@
 //
 
 #include "ams_utils.h"
+#include <OP/OP_Director.h>
+#include <cctype>
+#include <cstdlib>
 #include <regex>
 #include <vector>
 #include <map>
@@ -33,127 +36,171 @@ std::vector<OP_Node*> getInputAncestors(const OP_Node& node) {
   return ret;
 }
 
-/** @brief represents a backreference in a replacement string. i.e. the '~1' in: "hello~1world!" */
-class ExprObj {
-public:
-  /** @brief the backreference group number. i.e.: '1' in "~1".*/
-  int group;
-  /** @brief the position of the first character of the backreference expression in the replacement string.*/
-  int position;
-  /** @brief the size of the backreference expression.*/
-  int size;
-  ExprObj(int group, int position, int size) : group(group), position(position), size(size) {}
-  ExprObj() = default;
-  ~ExprObj() = default;
-  std::string ToStdString() {
-    stringstream ss;
-    ss << "(" << group << ", " << position << ", " << size << ")";
-    return ss.str();
+NodeWatcher::~NodeWatcher() {
+  reset();
+}
+
+
+void NodeWatcher::watch(OP_Node* node) {
+  for (OP_Node* n = node; n; n = n->getParent()) {
+    // If this node is already watched, so are its parents.
+    if (!myNodes.insert(n).second)
+      break;
+    n->addOpInterest(this, &NodeWatcher::handleOpEvent);
   }
-};
-
-// TODO: trim the fat.
-/**
- * @brief finds backreference expressions in a replacement string.
- * @param replace the replacement string to evaluate.
- * @param sorted if true, sort the map entries by backreference number.
- * @return a vector with the discovered backreference expressions.
- */
-vector<ExprObj> findExprIndices(const string& replace, bool sorted=false) {
-  const string expr = R"(~\d+)";
-  regex rgx(expr);
-  smatch m;
-  bool result = regex_search(replace, m, rgx);
-  auto ret = vector<ExprObj>();
-  if (!result) return ret;
-  
-  // accumulate backreference expression matches.
-  std::sregex_iterator next(replace.begin(), replace.end(), rgx);
-  std::sregex_iterator end;
-  while (next != end) {
-    std::smatch match = *next;
-    auto rawstr = match.str();
-    string stri = "";
-    for (int j = 1; j < rawstr.size(); j++) {
-      stri += rawstr[j];
+}
+
+
+void NodeWatcher::watchMissing(const char* path) {
+  std::string parent = path ? path : "";
+  while (!parent.empty()) {
+    auto slash = parent.find_last_of('/');
+    if (slash == std::string::npos)
+      return;
+    parent.erase(slash > 0 ? slash : 1);
+    OP_Node* node = OPgetDirector()->findNode(parent.c_str());
+    if (node) {
+      watch(node);
+      return;
     }
-    int num = atoi(stri.c_str());
-    int pos = match.position();
-    ret.push_back(ExprObj(num, pos, rawstr.size()));
-    
-    next++;
+    if (parent == "/")
+      return;
+  }
+}
+
+
+void NodeWatcher::reset() {
+  for (OP_Node* node : myNodes) {
+    node->removeOpInterest(this, &NodeWatcher::handleOpEvent);
   }
-  if (!sorted) {
-    return ret;
+  myNodes.clear();
+  myDirty = false;
+}
+
+
+void NodeWatcher::handleOpEvent(OP_Node* caller, void* callee, OP_EventType type, void* data) {
+  auto* watcher = static_cast<NodeWatcher*>(callee);
+  std::unique_lock<std::recursive_mutex> lock;
+  if (watcher->myLock)
+    lock = std::unique_lock<std::recursive_mutex>(*watcher->myLock);
+  switch (type) {
+    case OP_NODE_PREDELETE:
+      // The node takes its interests with it. Forget it so reset() doesn't touch it.
+      watcher->myNodes.erase(caller);
+      watcher->myDirty = true;
+      break;
+    case OP_NAME_CHANGED:
+      watcher->myDirty |= (watcher->myEvents & NAMES) != 0;
+      break;
+    case OP_CHILD_CREATED:
+    case OP_CHILD_DELETED:
+      watcher->myDirty |= (watcher->myEvents & CHILDREN) != 0;
+      break;
+    case OP_INPUT_CHANGED:
+    case OP_INPUT_REWIRED:
+      watcher->myDirty |= (watcher->myEvents & INPUTS) != 0;
+      break;
+    default:
+      break;
   }
-  
-  // sort the vector by backref number.
-  int i, j;
-  ExprObj key;
-  for (i = 1; i < ret.size(); i++) {
-    key = ret[i];
-    j = i - 1;
-    while (j >= 0 && ret[j].group > key.group) {
-      ret[j + 1] = ret[j];
-      j = j - 1;
+}
+
+
+CompiledReplace::CompiledReplace(const string& pattern, const string& replace)
+  : myReplace(replace), myMatchesNothing(pattern.empty()) {
+  if (!myMatchesNothing)
+    myRegex = regex(pattern);
+  parseReplace();
+}
+
+
+CompiledReplace::CompiledReplace(const regex& rgx, const string& replace)
+  : myRegex(rgx), myReplace(replace), myMatchesNothing(false) {
+  parseReplace();
+}
+
+
+void CompiledReplace::parseReplace() {
+  // split the replacement string into literal text and backreference expressions, i.e. "hello~1world!"
+  // becomes "hello", ~1, "world!".
+  size_t literal = 0;
+  size_t i = 0;
+  while (i < myReplace.size()) {
+    size_t digits = i + 1;
+    while (digits < myReplace.size() && isdigit((unsigned char) myReplace[digits]))
+      digits++;
+    if (myReplace[i] != '~' || digits == i + 1) {
+      i++;
+      continue;
     }
-    ret[j + 1] = key;
+    if (i > literal)
+      mySegments.push_back({-1, literal, i - literal});
+    mySegments.push_back({atoi(myReplace.c_str() + i + 1), i, digits - i});
+    literal = i = digits;
   }
-  return ret;
+  if (literal < myReplace.size())
+    mySegments.push_back({-1, literal, myReplace.size() - literal});
 }
 
-std::string ams::re_replace(const string& str, const regex& rgx, const string& replace) {
-  string result = str;
-  sregex_iterator next(str.begin(), str.end(), rgx);
-  sregex_iterator end;
-  auto inds = findExprIndices(replace);
-  bool hasGrpExpr = inds.size() > 0;
-  
-  if (hasGrpExpr)
-    // backreference expressions require result to equal the replacement string instead of the input string.
-    result = replace;
-  
-  // As the result string gets spliced/modified, its size will change.
-  // This variable stores the difference so we can always index the correct position in the string.
-  int offset = 0;
-
-  while (next != end) {
-    smatch match = *next;
-    if (match.size() == 1) {
-      // match does not contain backref groups
-      string s = match.str();
-      int pos = match.position()+offset;
-      result = sslice(result, 0, pos-1) + replace + sslice(result, pos+s.size(), result.size()-1);
-      offset += replace.size() - s.size();
-    } else {
-      // match contains backref groups
-      for (auto expr : inds) {
-        std::sub_match<string::const_iterator> grp;
-        try {
-          grp = match[expr.group];
-          if (!grp.matched) continue;
-        } catch (const std::exception& e) {
-          cout << "invalid group expression in replacement string: " << expr.ToStdString() << endl;
-          continue;
-        }
-        string s = grp.str();
-        auto size = grp.length();
-        auto pos = expr.position + offset;
-        result = sslice(result, 0, pos-1) + s + sslice(result, pos + expr.size, result.size()-1);
-        offset += s.size() - expr.size;
+
+string CompiledReplace::operator()(const string& str) const {
+  if (myMatchesNothing)
+    return str;
+  // First find every match and measure the result, so it can be built with a single allocation.
+  // For each match, spans holds the match followed by the span of each backreference segment.
+  const size_t unmatched = string::npos;
+  vector<std::pair<size_t, size_t>> spans;
+  size_t size = str.size();
+  for (sregex_iterator next(str.begin(), str.end(), myRegex), end; next != end; ++next) {
+    const smatch& match = *next;
+    spans.emplace_back(match.position(), match.length());
+    size -= match.length();
+    for (const auto& segment : mySegments) {
+      if (segment.group < 0) {
+        size += segment.size;
+      } else if (segment.group < (int) match.size() && match[segment.group].matched) {
+        spans.emplace_back(match.position(segment.group), match.length(segment.group));
+        size += match.length(segment.group);
+      } else {
+        // invalid group expression. Keep it as written.
+        spans.emplace_back(unmatched, 0);
+        size += segment.size;
+      }
+    }
+  }
+  if (spans.empty())
+    return str;
+
+  string result;
+  result.reserve(size);
+  size_t copied = 0;
+  for (auto span = spans.begin(); span != spans.end();) {
+    // the unmatched text before this match.
+    result.append(str, copied, span->first - copied);
+    copied = span->first + span->second;
+    ++span;
+    for (const auto& segment : mySegments) {
+      if (segment.group >= 0 && span->first != unmatched) {
+        result.append(str, span->first, span->second);
+      } else {
+        result.append(myReplace, segment.position, segment.size);
       }
+      if (segment.group >= 0)
+        ++span;
     }
-    next++;
   }
+  result.append(str, copied, string::npos);
   return result;
 }
 
+
+string re_replace(const string& str, const regex& rgx, const string& replace) {
+  return CompiledReplace(rgx, replace)(str);
+}
+
+
 string re_replace(const string& str, const string& pattern, const string& replace) {
-  if (pattern.size() == 0) {
-    return str;
-  }
-  regex rgx(pattern);
-  return re_replace(str, rgx, replace);
+  return CompiledReplace(pattern, replace)(str);
 }
 
 
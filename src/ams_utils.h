@@ -3,6 +3,9 @@
 //
 
 #pragma once
+#include <list>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 #include <regex>
@@ -15,6 +18,99 @@ namespace ams {
 std::vector<OP_Node*> getInputAncestors(const OP_Node& node);
 
 
+/**
+ * @brief listens for events which change what a node path resolves to.
+ * Caches which store node lookups use this to know when their entries can no longer be trusted.
+ * A watcher is flagged dirty when a watched node, or one of its parent networks, is deleted,
+ * or when any of the events it was created with occurs on one of them.
+ * A cache which is used from several threads passes its lock, which events then take before they
+ * change the watcher. The cache holds the same lock around every other call.
+ */
+class NodeWatcher {
+public:
+  /** @brief the events a watcher can be flagged dirty by, in addition to deletion. */
+  enum Events {
+    /** @brief a node was renamed. */
+    NAMES = 1,
+    /** @brief a child was created in or deleted from a network. */
+    CHILDREN = 2,
+    /** @brief the inputs of a node were changed. */
+    INPUTS = 4
+  };
+
+  explicit NodeWatcher(int events = NAMES | CHILDREN, std::recursive_mutex* lock = nullptr) : myEvents(events), myLock(lock) {}
+  ~NodeWatcher();
+  NodeWatcher(const NodeWatcher&) = delete;
+  NodeWatcher& operator=(const NodeWatcher&) = delete;
+
+  /** @brief watch a node and all of its parent networks. */
+  void watch(OP_Node* node);
+
+  /** @brief watch the deepest existing network along a path, so that creating the missing node is noticed. */
+  void watchMissing(const char* path);
+
+  /** @brief true if a watched event occurred since the last reset(). */
+  bool isDirty() const { return myDirty; }
+
+  /** @brief stop watching all nodes and clear the dirty flag. */
+  void reset();
+
+private:
+  static void handleOpEvent(OP_Node* caller, void* callee, OP_EventType type, void* data);
+
+  std::set<OP_Node*> myNodes;
+  int myEvents;
+  std::recursive_mutex* myLock;
+  bool myDirty = false;
+};
+
+
+/**
+ * @brief a regex replacement which is compiled once and applied to many strings.
+ * The pattern is compiled and the replacement string is split into literal and backreference
+ * segments when the object is constructed, so applying it only searches and copies.
+ * Each match is replaced by the replacement string. Using the tilde (~) key and a number,
+ * i.e.: ~1, references a numbered capture group of the match. References to groups which
+ * don't exist or didn't participate in the match are kept as written.
+ */
+class CompiledReplace {
+public:
+  /**
+   * @param pattern a regex pattern to search for. An empty pattern matches nothing.
+   * @param replace the replacement string.
+   */
+  CompiledReplace(const std::string& pattern, const std::string& replace);
+  /**
+   * @param rgx a regex object to use for searching.
+   * @param replace the replacement string.
+   */
+  CompiledReplace(const std::regex& rgx, const std::string& replace);
+
+  /**
+   * @brief applies the replacement to a string.
+   * @param str the string to modify
+   * @return the formatted string.
+   */
+  std::string operator()(const std::string& str) const;
+
+private:
+  /** @brief a piece of the replacement string. Literal text if group is negative, else a backreference. */
+  struct Segment {
+    int group;
+    /** @brief the position and size of the segment in the replacement string. */
+    size_t position;
+    size_t size;
+  };
+
+  void parseReplace();
+
+  std::regex myRegex;
+  std::string myReplace;
+  std::vector<Segment> mySegments;
+  bool myMatchesNothing;
+};
+
+
 /**
  * @brief replaces elements of string using a regex pattern.
  * @param str the string to modify
@@ -22,6 +118,7 @@ std::vector<OP_Node*> getInputAncestors(const OP_Node& node);
  * @param replace this will replace pattern in str. Using the tilde (~) key and a number,
  * i.e.: ~1, references a numbered capture group specified in the pattern.
  * @return the formatted string.
+ * @note when applying the same replacement to many strings, use CompiledReplace instead.
  */
 std::string re_replace(const std::string& str, const std::string& pattern, const std::string& replace);
 /**
@@ -31,10 +128,99 @@ std::string re_replace(const std::string& str, const std::string& pattern, const
  * @param replace this will replace pattern in str. Using the tilde (~) key and a number,
  * i.e.: ~1, references a numbered capture group specified in the pattern.
  * @return the formatted string.
+ * @note when applying the same replacement to many strings, use CompiledReplace instead.
  */
 std::string re_replace(const std::string& str, const std::regex& rgx, const std::string& replace);
 
 
+/**
+ * @brief a least recently used cache with a memory budget.
+ * Each value is inserted with its size, and the least recently used values are evicted
+ * once the sizes of all values add up to more than the budget.
+ * Keys are compared with ==, so lookups are linear. It is meant for few, large values.
+ * @tparam Key any type which implements the == operator.
+ * @tparam Value any movable type.
+ */
+template <class Key, class Value>
+class LRUCache {
+public:
+  /** @param budget the total size of the values the cache may hold. */
+  explicit LRUCache(size_t budget = 0) : myBudget(budget) {}
+
+  /**
+   * @brief finds a value, and marks it as the most recently used.
+   * @return the cached value, or nullptr if key isn't cached.
+   */
+  Value* find(const Key& key) {
+    for (auto it = myEntries.begin(); it != myEntries.end(); ++it) {
+      if (it->key == key) {
+        myEntries.splice(myEntries.begin(), myEntries, it);
+        return &myEntries.front().value;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief caches a value as the most recently used, replacing any value cached for the same key.
+   * A value larger than the whole budget is not cached.
+   */
+  void insert(const Key& key, Value value, size_t size) {
+    erase(key);
+    if (size > myBudget)
+      return;
+    myEntries.push_front({key, std::move(value), size});
+    myUsage += size;
+    evict();
+  }
+
+  /** @brief removes the value cached for key, if any. */
+  void erase(const Key& key) {
+    for (auto it = myEntries.begin(); it != myEntries.end(); ++it) {
+      if (it->key == key) {
+        myUsage -= it->size;
+        myEntries.erase(it);
+        return;
+      }
+    }
+  }
+
+  /** @brief changes the budget, evicting values until the cache fits it. */
+  void setBudget(size_t budget) {
+    myBudget = budget;
+    evict();
+  }
+
+  void clear() {
+    myEntries.clear();
+    myUsage = 0;
+  }
+
+  size_t size() const { return myEntries.size(); }
+
+  /** @brief the total size of the cached values. */
+  size_t usage() const { return myUsage; }
+
+private:
+  struct Entry {
+    Key key;
+    Value value;
+    size_t size;
+  };
+
+  void evict() {
+    while (myUsage > myBudget && !myEntries.empty()) {
+      myUsage -= myEntries.back().size;
+      myEntries.pop_back();
+    }
+  }
+
+  std::list<Entry> myEntries;
+  size_t myBudget;
+  size_t myUsage = 0;
+};
+
+
 /**
  * @brief slices a container object.
  * @tparam containerType any container which implements the [] operator.
@@ -0,0 +1,83 @@
+// Merges geometry files the way the AMS Object Merge merges objects, without loading a hip file.
+// Every input is copied into one detail in the order given, optionally transformed, tagged with
+// path and node path attributes and rewritten with regex rules, then the result is saved.
+// The files are merged by the same code as the node, see ams_mergefiles.h.
+// The inputs of a frame are loaded concurrently, and the frames of a range are merged concurrently.
+//
+// Usage:
+//   hams_merge [options] -o OUTPUT INPUT [--path PATH] [--xform M00,M01,...,M33] [INPUT ...]
+//
+// File names may contain $F or $F<n>, e.g. geo.$F4.bgeo.sc, which are replaced by the frame number,
+// padded to n digits.
+//
+// Options:
+//   -o, --output FILE         the file to write each frame to.
+//   -f, --frames START END    the frame range to merge. Defaults to frame 1.
+//   --step N                  merge every Nth frame of the range. Defaults to 1.
+//   -j, --threads N           the number of threads to use. Defaults to every core.
+//   --pathattrib NAME         the primitive attribute holding each input's path. Empty disables it.
+//   --nodepathattrib NAME     the primitive attribute holding each input's file name, with its frame
+//                             expanded. Empty disables it.
+//   --rule ATTRIBS PATTERN REPLACE
+//                             rewrites the string attributes matching ATTRIBS, e.g. shop_materialpath,
+//                             like the rewrite rules of the node. May be repeated.
+//   -v, --verbose             print each merged frame.
+//
+// Options which follow an input apply to that input only:
+//   --path PATH               the path written to the path attribute. Defaults to the file name without
+//                             its directory and extensions.
+//   --xform M00,...,M33       a row-major 4x4 matrix to transform the input by.
+
+#include "ams_mergefiles.h"
+#include <UT/UT_ParallelUtil.h>
+#include <UT/UT_StopWatch.h>
+#include <UT/UT_Thread.h>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+using namespace ams;
+
+
+int main(int argc, char* argv[]) {
+  MergeConfig config;
+  if (!parseArgs(argc, argv, config)) {
+    printUsage();
+    return 1;
+  }
+  if (config.threads > 0)
+    UT_Thread::configureMaxThreads(config.threads);
+
+  UT_StopWatch timer;
+  timer.start();
+  std::vector<int> frames;
+  for (int frame = config.start; frame <= config.end; frame += config.step)
+    frames.push_back(frame);
+
+  // Frames are independent jobs. Each one also loads its inputs in parallel, which the scheduler
+  // balances against the other frames.
+  std::mutex printlock;
+  std::atomic<int> failures(0);
+  UTparallelForEachNumber((exint) frames.size(), [&](const UT_BlockedRange<exint>& range) {
+    for (exint i = range.begin(); i != range.end(); ++i) {
+      std::vector<std::string> warnings;
+      std::string error = mergeFrame(config, frames[i], warnings);
+      std::lock_guard<std::mutex> lock(printlock);
+      for (const std::string& warning : warnings)
+        std::cerr << "Frame " << frames[i] << ": warning: " << warning << std::endl;
+      // A frame with errors isn't saved, and makes the whole job fail.
+      if (!error.empty()) {
+        failures++;
+        std::cerr << "Frame " << frames[i] << ": " << error << std::endl;
+      } else if (config.verbose) {
+        std::cout << "Merged frame " << frames[i] << std::endl;
+      }
+    }
+  });
+  if (config.verbose)
+    std::cout << "Merged " << frames.size() << " frame(s) in " << timer.stop() << "s" << std::endl;
+  return failures > 0 ? 1 : 0;
+}
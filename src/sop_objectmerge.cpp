@@ -15,8 +15,11 @@
  */
 #include "sop_objectmerge.h"
 #include "ams_utils.h"
+#include "ams_merge.h"
+#include "sop_objectmerge_verb.h"
 #include <SYS/SYS_Version.h>
 #include <GU/GU_Detail.h>
+#include <GA/GA_Handle.h>
 #include <OP/OP_Director.h>
 #include <OP/OP_Operator.h>
 #include <OP/OP_OperatorTable.h>
@@ -25,10 +28,14 @@
 #include <PRM/PRM_Parm.h>
 #include <UT/UT_DSOVersion.h>
 #include <UT/UT_DirUtil.h>
+#include <SYS/SYS_Math.h>
 #include <VOP/VOP_Node.h>
 #include <UT/UT_WorkArgs.h>
+#include <UT/UT_WorkBuffer.h>
 #include <map>
+#include <memory>
 #include <regex>
+#include <set>
 
 //#if SYS_VERSION_MAJOR_INT >= 19
 //#endif
@@ -64,20 +71,62 @@ static std::map<std::string, PRM_Name> parmNames = {
   {"enable",                PRM_Name("enable#", "Enable Merge #")},
   {"resolve_mats",          PRM_Name("resolve_mats", "Resolve Material Paths")},
   {"matnet_hint_path",      PRM_Name("matnet_hint_path", "Matnet Hint Path")},
+  {"match_mat_names",       PRM_Name("match_mat_names", "Match Material Names")},
   {"enable_pathattrib",     PRM_Name("enable_pathattrib", "Enable Path")},
   {"pathattrib_name",       PRM_Name("pathattrib_name", "Path Attribute")},
   {"resolve_subnets",       PRM_Name("resolve_subnets", "Resolve Subnets")},
+  {"path_encoding",         PRM_Name("path_encoding", "Path Encoding")},
   {"enable_nodepathattrib", PRM_Name("enable_nodepathattrib", "Enable Node Path")},
   {"nodepathattrib_name",   PRM_Name("nodepathattrib_name", "Node Path Attribute")},
+  {"delete_pointattribs",   PRM_Name("delete_pointattribs", "Delete Point Attributes")},
+  {"delete_vertexattribs",  PRM_Name("delete_vertexattribs", "Delete Vertex Attributes")},
+  {"delete_primattribs",    PRM_Name("delete_primattribs", "Delete Primitive Attributes")},
+  {"delete_detailattribs",  PRM_Name("delete_detailattribs", "Delete Detail Attributes")},
+  {"delete_groups",         PRM_Name("delete_groups", "Delete Groups")},
+  {"cook_parallel",         PRM_Name("cook_parallel", "Cook Objects in Parallel")},
+  {"incremental",           PRM_Name("incremental", "Update Changed Objects Only")},
+  {"cook_timings",          PRM_Name("cook_timings", "Output Cook Timings")},
+  {"pack",                  PRM_Name("pack", "Pack Geometry Before Merging")},
+  {"merge_parallel",        PRM_Name("merge_parallel", "Merge Objects in Parallel")},
+  {"frame_cache",           PRM_Name("frame_cache", "Cache Frames")},
+  {"frame_cache_budget",    PRM_Name("frame_cache_budget", "Cache Budget (MB)")},
+  {"numrules",              PRM_Name("numrules", "Rewrite Rules")},
+  {"rule_attrib",           PRM_Name("rule_attrib#", "Attributes #")},
+  {"rule_pattern",          PRM_Name("rule_pattern#", "Pattern #")},
+  {"rule_replace",          PRM_Name("rule_replace#", "Replace #")},
   {"None",                  PRM_Name(0)}
 };
 
+static PRM_Name pathEncodingItems[] = {
+  PRM_Name("strings", "String Attributes"),
+  PRM_Name("indexed", "Index Attributes and Path Tables"),
+  PRM_Name("both", "Both"),
+  PRM_Name(0)
+};
+static PRM_ChoiceList pathEncodingMenu(PRM_CHOICELIST_SINGLE, pathEncodingItems);
+
 static auto pathattrib_name_prmdefault = PRM_Default(0.0f, "path", CH_STRING_LITERAL);
 static auto nodepathattrib_name_prmdefault = PRM_Default(0.0f, "nodepath", CH_STRING_LITERAL);
 
+static auto frame_cache_budget_prmdefault = PRM_Default(512.0f);
+static auto frame_cache_budget_prmrange = PRM_Range(PRM_RANGE_RESTRICTED, 0.0f, PRM_RANGE_UI, 4096.0f);
+
+static auto rule_attrib_prmdefault = PRM_Default(0.0f, "path", CH_STRING_LITERAL);
+
+static PRM_Template theRuleTemplates[] = {
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["rule_attrib"], &rule_attrib_prmdefault,
+                       "The string attributes to rewrite. Accepts a list of names and wildcards."),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["rule_pattern"], 0,
+                       "A regex pattern to search for in the attribute values."),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["rule_replace"], 0,
+                       "Replaces each match of the pattern. ~1, ~2, etc. reference the capture groups of the pattern."),
+  PRM_Template()
+};
+
 static PRM_Template theObjectTemplates[] = {
   PRM_Template(PRM_TOGGLE, 1, &parmNames["enable"], PRMoneDefaults),
-  PRM_Template(PRM_STRING, PRM_TYPE_DYNAMIC_PATH, 1, &parmNames["objpath"], 0, 0, 0, 0, &PRM_SpareData::sopPath),
+  PRM_Template(PRM_STRING, PRM_TYPE_DYNAMIC_PATH, 1, &parmNames["objpath"], 0, 0, 0, 0, &PRM_SpareData::sopPath, 1,
+               "The objects or SOPs to merge. Accepts a list of paths, wildcard patterns and @bundles."),
   PRM_Template()
 };
 
@@ -88,6 +137,9 @@ PRM_Template SOP_ObjectMerge
                        "If a geometry's shop_materialpath contains an invalid material, attempt to find the material."),
   PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["matnet_hint_path"], PRMoneDefaults,
                        "A path leading to a matnet node to assist in finding materials."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["match_mat_names"], PRMzeroDefaults,
+                       "If a material can't be found by its path, use the material of the same name anywhere inside the matnet. "
+                       "Names which occur more than once inside the matnet are not matched."),
   PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["enable_pathattrib"], PRMoneDefaults,
                        "Creates a path attribute which describes the transform hierarchy of the object being merged. This is not to be confused with a node path."),
   PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["pathattrib_name"], &pathattrib_name_prmdefault,
@@ -98,8 +150,43 @@ PRM_Template SOP_ObjectMerge
                        "Creates a node path attribute. This is a path to the object node being merged."),
   PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["nodepathattrib_name"], &nodepathattrib_name_prmdefault,
                        "The name of the node path attribute to create."),
+  PRM_Template(PRM_ORD, 1, &parmNames["path_encoding"], PRMzeroDefaults, &pathEncodingMenu, 0, 0, 0, 1,
+               "How the path and node path attributes are stored. Indexed paths are written to a <name>_index "
+               "primitive attribute, which indexes into a <name>_table detail array of the unique paths."),
   PRM_Template(PRM_STRING, PRM_TYPE_DYNAMIC_PATH, 1, &parmNames["xformpath"],
                0, 0, 0, 0, &PRM_SpareData::objPath),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["delete_pointattribs"], 0,
+                       "Point attributes of the merged objects which are left out of the merge. Accepts names and wildcards; "
+                       "^ keeps a match, e.g. \"* ^N ^uv\" keeps only N and uv. P is always kept."),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["delete_vertexattribs"], 0,
+                       "Vertex attributes of the merged objects which are left out of the merge."),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["delete_primattribs"], 0,
+                       "Primitive attributes of the merged objects which are left out of the merge. "
+                       "The path and node path attributes are created after filtering."),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["delete_detailattribs"], 0,
+                       "Detail attributes of the merged objects which are left out of the merge."),
+  PRM_TemplateWithHelp(PRM_STRING, 1, &parmNames["delete_groups"], 0,
+                       "Point, vertex, primitive and edge groups of the merged objects which are left out of the merge."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["cook_parallel"], PRMzeroDefaults,
+                       "Cook the merged SOPs concurrently before merging them. Geometry is still merged in the order of the object list."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["merge_parallel"], PRMzeroDefaults,
+                       "Copy the geometry of all objects concurrently, each into its own range of the output. Only used when every object consists of polygons. "
+                       "Objects which share their cooked geometry are then copied in full each time, rather than duplicated from the first copy."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["incremental"], PRMoneDefaults,
+                       "When only the geometry of some merged objects changes, recopy just those objects in place instead of rebuilding the whole merge."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["pack"], PRMzeroDefaults,
+                       "Output one packed primitive per merged object. The packed primitives reference the cooked geometry instead of copying it."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["frame_cache"], PRMzeroDefaults,
+                       "Keep the merged geometry of recently cooked frames, so revisiting a frame whose objects haven't changed doesn't merge again. "
+                       "Frames are told apart by the data ids of the merged geometry, which animated SOPs renew every time they recook, "
+                       "so this only helps when the merged objects are static or only their transforms are animated."),
+  PRM_Template(PRM_FLT, 1, &parmNames["frame_cache_budget"], &frame_cache_budget_prmdefault, 0,
+               &frame_cache_budget_prmrange, 0, 0, 1,
+               "The memory the cached frames may use. The least recently used frames are dropped first."),
+  PRM_TemplateWithHelp(PRM_TOGGLE, 1, &parmNames["cook_timings"], PRMzeroDefaults,
+                       "Write where the time of each cook went to timing_* detail attributes: per phase, and per object. "
+                       "The phases are also recorded by the performance monitor."),
+  PRM_Template(PRM_MULTITYPE_LIST, theRuleTemplates, 3, &parmNames["numrules"], PRMzeroDefaults),
   PRM_Template(PRM_MULTITYPE_LIST, theObjectTemplates, 2, &parmNames["numobj"], PRMoneDefaults),
   PRM_Template()
 };
@@ -111,6 +198,12 @@ OP_Node* SOP_ObjectMerge
 }
 
 
+const SOP_NodeVerb* SOP_ObjectMerge
+::cookVerb() const {
+  return objectMergeVerb();
+}
+
+
 SOP_ObjectMerge
 ::SOP_ObjectMerge(OP_Network* net, const char* name, OP_Operator* entry)
   : SOP_Node(net, name, entry) {
@@ -128,10 +221,15 @@ SOP_ObjectMerge::~SOP_ObjectMerge() {}
 
 bool SOP_ObjectMerge
 ::updateParmsFlags() {
+  // The enable states only change along with the snapshot.
+  const ParmSnapshot& snapshot = parmSnapshot(myParmSnapshot.time);
+  if (snapshot.version == myParmFlagsVersion)
+    return false;
+  myParmFlagsVersion = snapshot.version;
   bool changed = false;
-  int n = NUMOBJ();
-  for (int i = 1; i <= n; i++) {
-    changed |= enableParmInst(parmNames["objpath"].getToken(), &i, ENABLEMERGE(i));
+  for (const ObjectEntry& entry : snapshot.entries) {
+    int i = entry.objindex;
+    changed |= enableParmInst(parmNames["objpath"].getToken(), &i, entry.enabled);
   }
   return changed;
 }
@@ -142,24 +240,19 @@ int SOP_ObjectMerge
   // don't do anything if we're locked
   if (flags().getHardLocked())
     return 1;
-  int numobj = NUMOBJ();
   // Determine if any of our SOPs are evil.
-  for (int objindex = 1; objindex <= numobj; objindex++) {
-    if (!ENABLEMERGE(objindex)) // Ignore disabled ones.
-      continue;
-    UT_String objname;
-    SOPPATH(objname, objindex, 0.0f);
-    OP_Network * objptr = (OP_Network*) findNode((const char*) objname);
-    if (!objptr)
-      continue;
-    // Self-referential nodes are assumed to have equal DandR ops,
-    // as it doesn't matter as they will be ignored and flagged
-    // as errors during cook anyways.
-    if (objptr == this) {
+  // The paths evaluated by the last cook are used, rather than evaluating every entry again.
+  for (const ObjectEntry& entry : parmSnapshot(myParmSnapshot.time).entries) {
+    if (!entry.enabled) // Ignore disabled ones.
       continue;
-    }
-    if (!objptr->getDandROpsEqual()) {
-      return 0;
+    for (OP_Node* node : entryNodes(entry)) {
+      // Self-referential nodes are assumed to have equal DandR ops,
+      // as it doesn't matter as they will be ignored and flagged
+      // as errors during cook anyways.
+      if (node == this)
+        continue;
+      if (!node->getDandROpsEqual())
+        return 0;
     }
   }
   // None of our interests was unequal, thus we are equal!
@@ -167,364 +260,584 @@ int SOP_ObjectMerge
 }
 
 
-std::vector<UT_String> SOP_ObjectMerge
-::parsePathString(UT_String& str) {
-  std::vector<UT_String> ret;
-  UT_WorkArgs paths;
-  // split spaces between paths.
-  str.tokenize(paths, ' ');
-  for (auto* path : paths) {
-    if (findNode(path)) {
-      ret.emplace_back(path);
+const ParmSnapshot& SOP_ObjectMerge
+::parmSnapshot(fpreal t) {
+  ParmSnapshot& snapshot = myParmSnapshot;
+  if (snapshot.valid && !mySourceWatcher.isDirty() && (!snapshot.timedependent || t == snapshot.time))
+    return snapshot;
+
+  // Entries which are all bundles or empty expand no paths, so the watcher is reset here as well.
+  if (mySourceWatcher.isDirty())
+    clearSourcePaths();
+  snapshot.version++;
+  snapshot.valid = true;
+  snapshot.time = t;
+  snapshot.timedependent = false;
+  snapshot.entries.clear();
+  int numobj = NUMOBJ();
+  snapshot.entries.reserve(numobj);
+  for (int objindex = 1; objindex <= numobj; objindex++) {
+    ObjectEntry entry{objindex, ENABLEMERGE(objindex) != 0, UT_StringHolder(), false, {}};
+    if (entry.enabled) {
+      PRM_Parm* parm = getParmPtrInst(parmNames["objpath"].getToken(), &objindex);
+      if (parm && parm->isTimeDependent())
+        snapshot.timedependent = true;
+      UT_String path;
+      SOPPATH(path, objindex, t);
+      entry.path = path;
+      entry.bundle = path.findChar('@') != nullptr;
+      if (path.isstring() && !entry.bundle)
+        entry.nodes = expandPathString(path);
     }
+    snapshot.entries.push_back(std::move(entry));
   }
-  return ret;
+  return snapshot;
 }
 
 
-void formatDirPath(UT_String& path) {
-  if (path.length() > 0 && path[path.length()-1] != '/') {
-    path.append('/');
-  }
+std::vector<OP_Node*> SOP_ObjectMerge
+::entryNodes(const ObjectEntry& entry) {
+  if (entry.bundle)
+    return expandPathString(UT_String(entry.path.c_str()));
+  return entry.nodes;
 }
 
-// TODO: figure out why Resolve Mats modifies shop_materialpath with strange material mappings.
-OP_ERROR SOP_ObjectMerge
-::cookMySop(OP_Context& context) {
-  fpreal t = context.getTime();
-  
-  #pragma region Get Params
-  updateHiddenParms();
-  // Get our xform object, if any.
-  UT_String objname;
-  XFORMPATH(objname, t);
-  OP_Network * xformobjptr = (OP_Network*) findNode(objname);
-  if (xformobjptr && xformobjptr->getOpTypeID() == SOP_OPTYPE_ID) {
-    // The user pointed to the SOP.  We silently promote it to the
-    // containing object.  This allows the intuitive "." to be used
-    // for the path to transform relative to our own op (rather than
-    // having to track up an arbitrary number of paths)
-    xformobjptr = xformobjptr->getCreator();
+
+void SOP_ObjectMerge
+::clearSourcePaths() {
+  // The UI callbacks may expand paths between cooks, so cached frames are dropped here,
+  // before the watcher forgets the change.
+  mySourcePaths.clear();
+  myFrameCache.clear();
+  mySourceWatcher.reset();
+}
+
+
+std::vector<OP_Node*> SOP_ObjectMerge
+::expandPathString(const UT_String& str) {
+  if (mySourceWatcher.isDirty())
+    clearSourcePaths();
+  // Bundle membership can change without any node events, so bundles are expanded every time.
+  // Reading a bundle doesn't search the node tree anyway.
+  bool cacheable = !str.findChar('@');
+  std::string key = str.toStdString();
+  if (cacheable) {
+    auto found = mySourcePaths.find(key);
+    if (found != mySourcePaths.end())
+      return found->second;
   }
-  // We must explicitly cast down as OBJ_Node * is unknown here.
-  // We also do the cast here instead of in findNode as we want
-  // to allow people to reference SOPs.
-  xformobjptr = (OP_Network*) CAST_OBJNODE(xformobjptr);
-  if (!xformobjptr && objname.isstring()) {
-    // We didn't get an xform object, but they had something typed,
-    // badmerge.
-    addError(SOP_BAD_SOP_MERGED, objname);
+  std::vector<OP_Node*> nodes;
+  UT_String pattern(UT_String::ALWAYS_DEEP, str);
+  UT_WorkArgs paths;
+  // split spaces between paths.
+  pattern.tokenize(paths, ' ');
+  for (auto* path : paths) {
+    UT_String expanded;
+    UT_ValArray<OP_Node*> matches;
+    globNodes(path, &expanded, &matches);
+    for (OP_Node* node : matches) {
+      nodes.push_back(node);
+      if (cacheable)
+        mySourceWatcher.watch(node);
+    }
+    if (!cacheable)
+      continue;
+    // Watch every network the pattern passes through, so that new or renamed nodes which would
+    // match, or complete a path which doesn't resolve yet, are noticed.
+    std::string partial(path);
+    for (auto slash = partial.find('/', 1); slash != std::string::npos; slash = partial.find('/', slash + 1)) {
+      UT_String prefixexpanded;
+      UT_ValArray<OP_Node*> networks;
+      globNodes(partial.substr(0, slash).c_str(), &prefixexpanded, &networks);
+      for (OP_Node* network : networks) {
+        mySourceWatcher.watch(network);
+      }
+    }
   }
-  int numobj = NUMOBJ();
+  if (cacheable)
+    mySourcePaths.emplace(key, nodes);
+  return nodes;
+}
 
-  //
-  //
-  // PATH ATTRIB
-  bool enablepathattrib = ENABLEPATHATTRIB();
-  UT_String pathattribname;
-  GA_Attribute* pathattrib = nullptr;
-  if (enablepathattrib) {
+
+MergeOptions SOP_ObjectMerge
+::mergeOptions(fpreal t) {
+  MergeOptions options;
+  options.pack = PACK();
+  options.cookparallel = COOKPARALLEL();
+  options.mergeparallel = MERGEPARALLEL();
+  options.resolvemats = RESOLVEMATS();
+  UT_String hintpath;
+  HINTPATH(hintpath);
+  options.hintpath = hintpath;
+  options.matchnames = MATCHMATNAMES();
+  options.resolvesubnets = RESOLVESUBNETS();
+  options.pathencoding = PATHENCODING();
+  // Unnamed path attributes are reported here rather than by the merge, as an in-place update skips it.
+  options.enablepathattrib = ENABLEPATHATTRIB();
+  if (options.enablepathattrib) {
+    UT_String pathattribname;
     PATHATTRIBNAME(pathattribname);
-    if (pathattribname.length() > 0) {
-      pathattrib = gdp->createStringAttribute(GA_ATTRIB_PRIMITIVE, GA_SCOPE_PUBLIC, pathattribname);
-    } else {
+    options.pathattrib = pathattribname;
+    if (!pathattribname.isstring()) {
       addWarning(SOP_ErrorCodes::SOP_ATTRIBUTE_INVALID);
-      enablepathattrib = false;
+      options.enablepathattrib = false;
     }
   }
-  
-  //
-  //
-  // NODE PATH ATTRIB
-  bool enable_nodepathattrib = ENABLENODEPATHATTRIB();
-  UT_String nodepathattribname;
-  GA_Attribute* nodepathattrib = nullptr;
-  if (enable_nodepathattrib) {
+  options.enablenodepathattrib = ENABLENODEPATHATTRIB();
+  if (options.enablenodepathattrib) {
+    UT_String nodepathattribname;
     NODEPATHATTRIBNAME(nodepathattribname);
-    if (nodepathattribname.length() > 0) {
-      nodepathattrib = gdp->createStringAttribute(GA_ATTRIB_PRIMITIVE, GA_SCOPE_PUBLIC, nodepathattribname);
-    } else {
+    options.nodepathattrib = nodepathattribname;
+    if (!nodepathattribname.isstring()) {
       addWarning(SOP_ErrorCodes::SOP_ATTRIBUTE_INVALID);
-      enable_nodepathattrib = false;
+      options.enablenodepathattrib = false;
     }
   }
-  
-  // RESOLVE MATS
-  bool resolve_mats = RESOLVEMATS();;
-  UT_String hintpath;
-  HINTPATH(hintpath);
-  formatDirPath(hintpath);
-  #pragma endregion Get Params
+  UT_String xformpath;
+  XFORMPATH(xformpath, t);
+  options.xformpath = xformpath;
+  DELETEPOINTATTRIBS(options.filter.attribs[GA_ATTRIB_POINT], t);
+  DELETEVERTEXATTRIBS(options.filter.attribs[GA_ATTRIB_VERTEX], t);
+  DELETEPRIMATTRIBS(options.filter.attribs[GA_ATTRIB_PRIMITIVE], t);
+  DELETEDETAILATTRIBS(options.filter.attribs[GA_ATTRIB_DETAIL], t);
+  DELETEGROUPS(options.filter.groups, t);
+  options.rules = getRewriteRules(t);
+  return options;
+}
 
-  #pragma region Main Loop
-  // MAIN LOOP
-  // Peek whether we are a render cook or not.
-  int cookrender = getCreator()->isCookingRender();
-  bool copiedfirst = false;
-  bool copiedlast = false;
-  // this is an iterated value that increments only when geometry is merged.
-  int cooked_objindx = 1;
-  for (int objindex = 1; objindex <= numobj; objindex++) {
-    if (!ENABLEMERGE(objindex))             // Ignore disabled ones.
-      continue;
-    UT_String soppathstr;
-    SOPPATH(soppathstr, objindex, t);
-    if (!soppathstr.isstring())
-      continue;                           // Blank means ignore.
-    for (auto soppath : parsePathString(soppathstr)) {
-      SOP_Node* sopptr = getSOPNode(soppath, 1); // We want extra inputs.
-      if (sopptr == this) {
-        // Self-reference.  Special brand of evil.
-        addWarning(SOP_ERR_SELFMERGE);
-        continue;
-      }
-      if (!sopptr) {
-        // Illegal merge.  Just warn so we don't abort everything.
-        addWarning(SOP_BAD_SOP_MERGED, soppath);
-        continue;
-      }
-      // Get the creator, which is our objptr.
-      OP_Network * objptr = sopptr->getCreator();
-      // Change over so any subnet evaluation will properly track...
-      int savecookrender = objptr->isCookingRender();
-      objptr->setCookingRender(cookrender);
-      // Actually cook...
-      const GU_Detail* cookedgdp = sopptr->getCookedGeo(context);
-      // Restore the cooking render state.
-      objptr->setCookingRender(savecookrender);
-      if (!cookedgdp) {
-        // Something went wrong with the cooking. Warn the hapless user.
-        addWarning(SOP_BAD_SOP_MERGED, soppath);
+
+class SOP_ObjectMerge::CookHost : public MergeHost {
+public:
+  explicit CookHost(SOP_ObjectMerge& sop) : mySop(sop) {}
+
+  OP_Node* node() override { return &mySop; }
+
+  std::vector<OP_Node*> entryNodes(const ObjectEntry& entry) override { return mySop.entryNodes(entry); }
+
+  void addDependency(OP_Node* node, OP_InterestType type) override { mySop.addExtraInput(node, type); }
+
+  void addWarning(SOP_ErrorCodes code, const char* msg) override { mySop.addWarning(code, msg); }
+
+  void addError(SOP_ErrorCodes code, const char* msg) override { mySop.addError(code, msg); }
+
+  void addTransformError(const OP_Node& node, const char* label) override { mySop.addTransformError(node, label); }
+
+  HierarchyPaths& hierarchyPaths() override { return mySop.myHierPaths; }
+
+  MaterialLibrary& materials() override { return mySop.myMaterials; }
+
+private:
+  SOP_ObjectMerge& mySop;
+};
+
+
+void SOP_ObjectMerge
+::opChanged(OP_EventType reason, void* data) {
+  SOP_Node::opChanged(reason, data);
+  // Any parameter may change the layout of the merge, so the next cook starts over.
+  if (reason == OP_PARM_CHANGED) {
+    myParmSnapshot.valid = false;
+    myMergedSources.clear();
+    myFrameCache.clear();
+  }
+}
+
+
+SOP_ObjectMerge::MergedSource SOP_ObjectMerge
+::snapshotSource(const MergeSource& source, bool resolve_mats) {
+  const GU_Detail& geo = *source.cookedgdp;
+  // A filtered copy gets new data ids every cook, so they are read from the detail it was copied from.
+  // It has every attribute and group the copy kept.
+  const GU_Detail& cooked = *source.sourcegdp;
+  MergedSource merged;
+  merged.sopid = source.sopptr->getUniqueId();
+  merged.gdpid = source.cookedid;
+  merged.topologyid = cooked.getTopology().getDataId();
+  merged.primlistid = cooked.getPrimitiveList().getDataId();
+  merged.pointstart = merged.vertexstart = merged.primstart = 0;
+  merged.numpoints = geo.getNumPoints();
+  merged.numvertices = geo.getNumVertices();
+  merged.numprims = geo.getNumPrimitives();
+  merged.xform.identity();
+  merged.nodepath = source.nodepath;
+  merged.hierpath = source.hierpath;
+  if (resolve_mats) {
+    UT_String objshoppath;
+    source.objptr->getParm("shop_materialpath").getValue(0.0f, objshoppath, 0, true, 0);
+    merged.objmaterial = objshoppath;
+  }
+  for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL}) {
+    for (auto it = geo.getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+      const GA_Attribute* attr = cooked.findAttribute(owner, it.attrib()->getName());
+      merged.attribids[{owner, it.attrib()->getName().toStdString()}] = (attr ? attr : it.attrib())->getDataId();
+    }
+  }
+  auto snapshotGroups = [&merged](const auto& table, const auto& cookedtable, GA_GroupType type) {
+    for (auto it = table.beginTraverse(); !it.atEnd(); ++it) {
+      if (it.group()->isInternal())
         continue;
+      auto* group = cookedtable.find(it.group()->getName());
+      merged.groupids[{type, it.group()->getName().toStdString()}] = (group ? group : it.group())->getDataId();
+    }
+  };
+  snapshotGroups(geo.pointGroups(), cooked.pointGroups(), GA_GROUP_POINT);
+  snapshotGroups(geo.vertexGroups(), cooked.vertexGroups(), GA_GROUP_VERTEX);
+  snapshotGroups(geo.primitiveGroups(), cooked.primitiveGroups(), GA_GROUP_PRIMITIVE);
+  snapshotGroups(geo.edgeGroups(), cooked.edgeGroups(), GA_GROUP_EDGE);
+  return merged;
+}
+
+
+SOP_ObjectMerge::FrameKey SOP_ObjectMerge
+::frameKey(fpreal t, const std::vector<MergeSource>& sources) {
+  FrameKey key{t, {}, {}};
+  for (const MergeSource& source : sources) {
+    key.xforms.push_back(source.xform);
+    key.ids.push_back(source.sopptr->getUniqueId());
+    if (!source.cookedgdp) {
+      key.ids.push_back(-1);
+      continue;
+    }
+    // Data ids stay the same when an upstream SOP recooks without changing its geometry, unlike the meta
+    // cache count. They are read from the detail the SOP cooked, as a filtered copy is made anew every cook.
+    const GU_Detail& geo = *source.sourcegdp;
+    key.ids.push_back(source.cookedid);
+    key.ids.push_back(geo.getTopology().getDataId());
+    key.ids.push_back(geo.getPrimitiveList().getDataId());
+    for (GA_AttributeOwner owner : {GA_ATTRIB_POINT, GA_ATTRIB_VERTEX, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL}) {
+      for (auto it = geo.getAttributeDict(owner).begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it) {
+        key.ids.push_back(exint(it.attrib()->getName().hash()));
+        key.ids.push_back(it.attrib()->getDataId());
       }
-      // Now add the extra inputs...
-      addExtraInput(objptr, OP_INTEREST_DATA);
-      // The sop extra inputs were set by the getSOPNode
-      bool firstmerge = !copiedfirst;
-      // Choose the best copy method we can
-      GEO_CopyMethod copymethod = GEO_COPY_ADD;
-      if (!copiedfirst) {
-        copymethod = GEO_COPY_START;
-        copiedfirst = true;
-        if (objindex == numobj) {
-          copymethod = GEO_COPY_ONCE;
-          copiedlast = true;
-        }
-      } else if (objindex == numobj) {
-        copymethod = GEO_COPY_END;
-        copiedlast = true;
-      }
-      // Mark where the new prims and points start
-      GA_IndexMap::Marker pointmarker(gdp->getPointMap());
-      GA_IndexMap::Marker primmarker(gdp->getPrimitiveMap());
-
-      // Don't copy internal groups!
-      // Accumulation of internal groups may ensue.
-      gdp->copy(*cookedgdp, copymethod, true, false, GA_DATA_ID_CLONE);
-      // Apply the transform.
-      if (xformobjptr) {
-        // GEO_Detail::transform supports double-precision,
-        // so we might as well use double-precision transforms.
-        UT_Matrix4D xform, xform2;
-        if (!objptr->getWorldTransform(xform, context))
-          addTransformError(*objptr, "world");
-        if (!xformobjptr->getIWorldTransform(xform2, context))
-          addTransformError(*xformobjptr, "inverse world");
-        xform *= xform2;
-        if (firstmerge) {
-          // The first object we merge we can just do a full gdp transform
-          // rather than building the subgroup.
-          gdp->transform(xform);
-        } else {
-          gdp->transform(xform, primmarker.getRange(), pointmarker.getRange(), false);
-        }
+    }
+    auto keyGroups = [&key](const auto& table) {
+      for (auto it = table.beginTraverse(); !it.atEnd(); ++it) {
+        if (it.group()->isInternal())
+          continue;
+        key.ids.push_back(exint(it.group()->getName().hash()));
+        key.ids.push_back(it.group()->getDataId());
       }
+    };
+    keyGroups(geo.pointGroups());
+    keyGroups(geo.vertexGroups());
+    keyGroups(geo.primitiveGroups());
+    keyGroups(geo.edgeGroups());
+  }
+  return key;
+}
 
-      if (enablepathattrib) {
-        gdp->addAttribute(pathattribname, nullptr, nullptr, "string", GA_ATTRIB_PRIMITIVE);
-        // Create a path from the hierarchy of transforms. This is not to be confused with a node "directory" path.
-        UT_String path(resolvePath(*objptr, RESOLVESUBNETS()));
-        GA_Iterator it;
-        if (cooked_objindx == 1) {
-          // for loop doesn't evaluate primmarker on first run. Get global prim iterator instead.
-          it = gdp->getPrimitiveRange().begin();
-        } else {
-          it = primmarker.getRange().begin();
-        }
-        GA_RWHandleS handle(gdp, GA_ATTRIB_PRIMITIVE, pathattribname);
-        if (handle.isValid())
-          for (; !it.atEnd(); ++it) {
-            auto offset = *it;
-            handle->setString(offset, path);
-          }
-      }
 
-      if (enable_nodepathattrib) {
-        gdp->addAttribute(nodepathattribname, nullptr, nullptr, "string", GA_ATTRIB_PRIMITIVE);
-        GA_Iterator it;
-        if (cooked_objindx == 1) {
-          // for loop doesn't evaluate primmarker on first run. Get global prim iterator instead.
-          it = gdp->getPrimitiveRange().begin();
-        } else {
-          it = primmarker.getRange().begin();
-        }
-        GA_RWHandleS handle(gdp, GA_ATTRIB_PRIMITIVE, nodepathattribname);
-        if (handle.isValid())
-          for (; !it.atEnd(); ++it) {
-            auto offset = *it;
-            handle->setString(offset, objptr->getFullPath());
-          }
+bool SOP_ObjectMerge
+::updateMergedSources(const std::vector<MergeSource>& sources, const MergeOptions& options) {
+  // gdp must still be the detail we merged into, with the topology we left it with.
+  if (myMergedSources.empty() || sources.size() != myMergedSources.size()
+      || myMergedGdpId != gdp->getUniqueId() || myMergedTopologyId != gdp->getTopology().getDataId()
+      || myMergedPrimListId != gdp->getPrimitiveList().getDataId())
+    return false;
+  bool resolve_mats = options.resolvemats;
+  std::set<std::string> tagnames;
+  for (auto& tag : {std::make_pair(options.enablepathattrib, options.pathattrib),
+                    std::make_pair(options.enablenodepathattrib, options.nodepathattrib)}) {
+    if (tag.first && tag.second.isstring()) {
+      tagnames.insert(tag.second.toStdString());
+      tagnames.insert(indexAttribName(tag.second.c_str()).toStdString());
+    }
+  }
+  // An attribute is recopied if its data changed, or if it has to be transformed again.
+  auto needsCopy = [](const GA_Attribute* attr, GA_DataId id, GA_DataId lastid, bool retransform) {
+    return id != lastid || (retransform && attr->needsTransform());
+  };
+
+  // First make sure every source still fits the ranges it occupies, so gdp is never left half updated.
+  std::vector<MergedSource> current;
+  std::vector<bool> retransform;
+  for (size_t i = 0; i < sources.size(); i++) {
+    const MergeSource& source = sources[i];
+    const MergedSource& last = myMergedSources[i];
+    if (!source.cookedgdp || source.sopptr->getUniqueId() != last.sopid)
+      return false;
+    const GU_Detail& geo = *source.cookedgdp;
+    MergedSource merged = snapshotSource(source, resolve_mats);
+    merged.pointstart = last.pointstart;
+    merged.vertexstart = last.vertexstart;
+    merged.primstart = last.primstart;
+    if (source.transformed)
+      merged.xform = source.xform;
+    if (merged.gdpid != last.gdpid || merged.topologyid != last.topologyid || merged.primlistid != last.primlistid
+        || merged.numpoints != last.numpoints || merged.numvertices != last.numvertices
+        || merged.numprims != last.numprims || merged.groupids != last.groupids
+        || merged.hierpath != last.hierpath || merged.nodepath != last.nodepath
+        || merged.objmaterial != last.objmaterial || merged.attribids.size() != last.attribids.size()
+        || !geo.getPointMap().isTrivialMap() || !geo.getVertexMap().isTrivialMap()
+        || !geo.getPrimitiveMap().isTrivialMap())
+      return false;
+    bool transformed = source.transformed && merged.xform != last.xform;
+    for (auto& entry : merged.attribids) {
+      auto found = last.attribids.find(entry.first);
+      if (found == last.attribids.end())
+        return false;
+      auto owner = GA_AttributeOwner(entry.first.first);
+      // Detail attributes are shared by all sources, so they can't be updated per source.
+      if (owner == GA_ATTRIB_DETAIL) {
+        if (found->second != entry.second)
+          return false;
+        continue;
       }
+      if (!gdp->findAttribute(owner, entry.first.second.c_str()))
+        return false;
+      const GA_Attribute* attr = geo.findAttribute(owner, entry.first.second.c_str());
+      // Rewrite rules run over whole string tables, so a recopied target would have to be rewritten twice.
+      if (entry.second != found->second && attr->getAIFSharedStringTuple()
+          && isRewriteTarget(entry.first.second.c_str(), options.rules))
+        return false;
+      transformed |= source.transformed && attr->needsTransform() && entry.second != found->second;
+    }
+    // A mirroring transform reversed the primitives of the last cook, and reversing the recopied
+    // attributes again would flip them back, so those sources are merged from scratch.
+    if (transformed && (merged.xform.determinant3() < 0 || !hasOnlyPointTransforms(geo)))
+      return false;
+    current.push_back(merged);
+    retransform.push_back(transformed);
+  }
 
-      if (resolve_mats) {
-        resolveMaterials(primmarker, objptr, cooked_objindx);
-      }
+  // Now recopy the sources which changed into their ranges.
+  UT_StringHolder hintpath;
+  if (resolve_mats)
+    hintpath = myMaterials.resolveHintPath(this, options.hintpath);
+  myCookStats.sourcemergetimes.assign(sources.size(), 0.0);
+  myCookStats.sourceprims.assign(sources.size(), 0);
+  for (size_t i = 0; i < sources.size(); i++) {
+    const MergedSource& last = myMergedSources[i];
+    const MergedSource& merged = current[i];
+    if (merged.attribids == last.attribids && !retransform[i])
+      continue;
+    PhaseTimer sourcetimer("Merge Object", sources[i].soppath.c_str(), myCookStats.sourcemergetimes[i]);
+    myCookStats.sourceprims[i] = merged.numprims;
+    const GU_Detail& geo = *sources[i].cookedgdp;
+    GA_Range pointrange(gdp->getPointMap(), merged.pointstart, merged.pointstart + merged.numpoints);
+    GA_Range vertexrange(gdp->getVertexMap(), merged.vertexstart, merged.vertexstart + merged.numvertices);
+    GA_Range primrange(gdp->getPrimitiveMap(), merged.primstart, merged.primstart + merged.numprims);
+    bool copiedmats = false;
+    for (auto& entry : merged.attribids) {
+      auto owner = GA_AttributeOwner(entry.first.first);
+      const char* name = entry.first.second.c_str();
+      if (owner == GA_ATTRIB_DETAIL)
+        continue;
+      // The tagging attributes are written by us, not copied.
+      if (owner == GA_ATTRIB_PRIMITIVE && tagnames.count(name))
+        continue;
+      const GA_Attribute* srcattr = geo.findAttribute(owner, name);
+      if (!needsCopy(srcattr, entry.second, last.attribids.at(entry.first), retransform[i]))
+        continue;
+      GA_Attribute* destattr = gdp->findAttribute(owner, name);
+      const GA_Range& destrange = owner == GA_ATTRIB_POINT ? pointrange
+                                  : owner == GA_ATTRIB_VERTEX ? vertexrange : primrange;
+      destattr->copy(destrange, *srcattr, GA_Range(geo.getIndexMap(owner)));
+      destattr->bumpDataId();
+      copiedmats |= owner == GA_ATTRIB_PRIMITIVE && entry.first.second == "shop_materialpath";
     }
-    cooked_objindx++;
+    if (retransform[i])
+      gdp->transform(merged.xform, primrange, pointrange, false);
+    if (resolve_mats && copiedmats)
+      resolveMaterials(*gdp, primrange, *sources[i].objptr, myMaterials, hintpath, options.matchnames);
   }
-  #pragma endregion Main Loop
+  myMergedSources = current;
+  return true;
+}
+
+
+// TODO: figure out why Resolve Mats modifies shop_materialpath with strange material mappings.
+OP_ERROR SOP_ObjectMerge
+::cookMySop(OP_Context& context) {
+  fpreal t = context.getTime();
+  myCookStats = MergeStats();
+  PhaseTimer totaltimer("Object Merge", getFullPath().c_str(), myCookStats.totaltime);
   
-  if (xformobjptr) {
-    addExtraInput(xformobjptr, OP_INTEREST_DATA);
+  #pragma region Get Params
+  updateHiddenParms();
+  // Material lookups and hierarchy paths are kept across cooks until a node they were found through changes.
+  // Cached frames were merged with node paths, hierarchy paths and materials which may no longer hold.
+  bool materialschanged = myMaterials.refresh();
+  bool hierpathschanged = myHierPaths.refresh();
+  if (materialschanged || hierpathschanged || mySourceWatcher.isDirty())
+    myFrameCache.clear();
+  parmSnapshot(t);
+  myParmSnapshot.options = mergeOptions(t);
+  const ParmSnapshot& snapshot = myParmSnapshot;
+  const MergeOptions& options = snapshot.options;
+  #pragma endregion Get Params
+
+  #pragma region Cook Sources
+  // The same steps as the verb: sources are resolved, cooked and filtered, and their transforms and paths
+  // worked out, before anything is copied.
+  CookHost host(*this);
+  std::vector<MergeSource> sources = gatherSources(snapshot, host, context, myCookStats);
+  #pragma endregion Cook Sources
+
+  #pragma region Frame Cache
+  FrameKey framekey;
+  bool framecache = FRAMECACHE();
+  if (framecache) {
+    myFrameCache.setBudget(size_t(SYSmax(FRAMECACHEBUDGET(t), 0.0) * 1024 * 1024));
+    framekey = frameKey(t, sources);
+    if (FrameEntry* cached = myFrameCache.find(framekey)) {
+      // gdp shares the pages of the cached detail until either is written to.
+      gdp->replaceWith(*cached->gdh.gdp());
+      gdp->bumpAllDataIds();
+      myMergedSources = cached->merged;
+      select(GA_GROUP_PRIMITIVE);
+      myMergedGdpId = gdp->getUniqueId();
+      myMergedTopologyId = gdp->getTopology().getDataId();
+      myMergedPrimListId = gdp->getPrimitiveList().getDataId();
+      return error();
+    }
+  } else {
+    myFrameCache.clear();
   }
-  // Finish & clean up the copy procedure, if not already done.
-  if (!copiedfirst) {
-    gdp->clearAndDestroy();
-  } else if (!copiedlast) {
-    GU_Detail blank_gdp;
-    gdp->copy(blank_gdp, GEO_COPY_END, true, false, GA_DATA_ID_CLONE);
+  #pragma endregion Frame Cache
+
+  #pragma region Main Loop
+  // If nothing but the geometry of some sources changed since the last cook, those sources are
+  // recopied into the ranges they already occupy and the rest of gdp is left untouched.
+  bool updated = false;
+  if (!options.pack && INCREMENTAL()) {
+    PhaseTimer copytimer("Copy Objects", getFullPath().c_str(), myCookStats.copytime);
+    updated = updateMergedSources(sources, options);
   }
+  myCookStats.incremental = updated;
+  if (!updated) {
+    myMergedSources.clear();
+    MergeResult result = mergeSources(*gdp, sources, options, host, myCookStats);
+    // Remember where each source landed, so the next cook can update it in place.
+    // Ranges can only be reused if every source was merged and gdp is laid out without holes.
+    if (result.laidout) {
+      myMergedSources.reserve(sources.size());
+      for (size_t i = 0; i < sources.size(); i++) {
+        MergedSource merged = snapshotSource(sources[i], options.resolvemats);
+        merged.pointstart = GA_Offset(result.ranges[i].points.start);
+        merged.vertexstart = GA_Offset(result.ranges[i].vertices.start);
+        merged.primstart = GA_Offset(result.ranges[i].prims.start);
+        if (sources[i].transformed)
+          merged.xform = sources[i].xform;
+        myMergedSources.push_back(merged);
+      }
+    }
+  }
+  #pragma endregion Main Loop
+
   // Set the node selection for this primitive. This will highlight all
   // the primitives of the node, but only if the highlight flag for this node
   // is on and the node is selected.
   if (error() < UT_ERROR_ABORT)
     select(GA_GROUP_PRIMITIVE);
+  else
+    myMergedSources.clear();
+  if (COOKTIMINGS() && error() < UT_ERROR_ABORT) {
+    totaltimer.stop();
+    writeCookStats(sources);
+  }
+  // Only clean cooks are cached, so a cache hit never hides a warning.
+  if (framecache && error() < UT_ERROR_WARNING) {
+    GU_DetailHandle cached;
+    cached.allocateAndSet(new GU_Detail());
+    cached.gdpNC()->replaceWith(*gdp);
+    myFrameCache.insert(framekey, {cached, myMergedSources}, (size_t) cached.gdp()->getMemoryUsage(true));
+  }
+  myMergedGdpId = gdp->getUniqueId();
+  myMergedTopologyId = gdp->getTopology().getDataId();
+  myMergedPrimListId = gdp->getPrimitiveList().getDataId();
   return error();
 }
 
 
-void SOP_ObjectMerge
-::updateHiddenParms() {
-  bool enablePathattrib = ENABLEPATHATTRIB();
-  bool resolveMats = RESOLVEMATS();
-  bool enableNodePathattrib = ENABLENODEPATHATTRIB();
-  
-  this->getParm(parmNames["matnet_hint_path"].getToken()).setVisibleState(resolveMats);
-  this->getParm(parmNames["pathattrib_name"].getToken()).setVisibleState(enablePathattrib);
-  this->getParm(parmNames["resolve_subnets"].getToken()).setVisibleState(enablePathattrib);
-  this->getParm(parmNames["nodepathattrib_name"].getToken()).setVisibleState(enableNodePathattrib);
-}
-
-
-UT_String SOP_ObjectMerge
-::resolvePath(const OP_Node& node, bool resolve_subnets) {
-  UT_String path;
-  auto dir = OPgetDirector();
-  node.getFullPath(path);
-  auto ancestors = ams::getInputAncestors(node);
-
-  UT_String parentHier = "";
-  for (auto* n : ancestors) {
-    auto name = n->getName();
-    name.prepend("/");
-    parentHier.prepend(name);
+std::vector<RewriteRule> SOP_ObjectMerge
+::getRewriteRules(fpreal t) {
+  std::vector<RewriteRule> rules;
+  int numrules = NUMRULES();
+  for (int i = 1; i <= numrules; i++) {
+    UT_String attribs, pattern, replace;
+    RULEATTRIB(attribs, i, t);
+    RULEPATTERN(pattern, i, t);
+    RULEREPLACE(replace, i, t);
+    if (!attribs.isstring() || !pattern.isstring())
+      continue;
+    try {
+      rules.push_back({UT_StringHolder(attribs), std::make_shared<CompiledReplace>(pattern.toStdString(), replace.toStdString())});
+    } catch (const std::regex_error& e) {
+      UT_WorkBuffer msg;
+      msg.sprintf("Invalid rewrite pattern '%s': %s", pattern.c_str(), e.what());
+      addWarning(SOP_MESSAGE, msg.buffer());
+    }
   }
+  return rules;
+}
 
-  if (resolve_subnets) {
-    const OP_Node* rootAtLevel;
-    if (ancestors.empty()) {
-      rootAtLevel = &node;
-    } else {
-      rootAtLevel = ancestors[ancestors.size() - 1];
-    }
-    auto type = rootAtLevel->getOpType();
-    auto* subnParent = rootAtLevel->getParent();
 
-    if (subnParent && subnParent->getOpType() == type) {
-      auto upstream = resolvePath(*subnParent, resolve_subnets);
-      parentHier.prepend(upstream);
+void SOP_ObjectMerge
+::writeCookStats(const std::vector<MergeSource>& sources) {
+  auto writeTime = [this](const char* name, fpreal value) {
+    GA_RWHandleD handle(gdp->addFloatTuple(GA_ATTRIB_DETAIL, name, 1, GA_Defaults(0.0), nullptr, nullptr, GA_STORE_REAL64));
+    if (handle.isValid()) {
+      handle.set(GA_Offset(0), value);
+      handle.bumpDataId();
     }
+  };
+  writeTime("timing_total_ms", myCookStats.totaltime);
+  writeTime("timing_resolve_ms", myCookStats.resolvetime);
+  writeTime("timing_cook_ms", myCookStats.cooktime);
+  writeTime("timing_copy_ms", myCookStats.copytime);
+  writeTime("timing_transform_ms", myCookStats.transformtime);
+  writeTime("timing_tag_ms", myCookStats.tagtime);
+  writeTime("timing_material_ms", myCookStats.materialtime);
+  writeTime("timing_rewrite_ms", myCookStats.rewritetime);
+  GA_RWHandleI incremental(gdp->addIntTuple(GA_ATTRIB_DETAIL, "timing_incremental", 1));
+  if (incremental.isValid()) {
+    incremental.set(GA_Offset(0), myCookStats.incremental);
+    incremental.bumpDataId();
   }
 
-  parentHier.append("/");
-  parentHier.append(node.getName());
-  return parentHier;
+  // Per object arrays, in merge order.
+  UT_StringArray paths;
+  UT_Fpreal64Array cooktimes, mergetimes;
+  UT_Int64Array prims;
+  for (size_t i = 0; i < sources.size(); i++) {
+    paths.append(sources[i].soppath);
+    cooktimes.append(sources[i].cooktime);
+    mergetimes.append(i < myCookStats.sourcemergetimes.size() ? myCookStats.sourcemergetimes[i] : 0.0);
+    prims.append(i < myCookStats.sourceprims.size() ? myCookStats.sourceprims[i] : 0);
+  }
+  GA_RWHandleSA pathhandle(gdp->addStringArray(GA_ATTRIB_DETAIL, "timing_objects"));
+  GA_RWHandleDA cookhandle(gdp->addFloatArray(GA_ATTRIB_DETAIL, "timing_object_cook_ms", 1, nullptr, nullptr, GA_STORE_REAL64));
+  GA_RWHandleDA mergehandle(gdp->addFloatArray(GA_ATTRIB_DETAIL, "timing_object_merge_ms", 1, nullptr, nullptr, GA_STORE_REAL64));
+  GA_RWHandleIA primhandle(gdp->addIntArray(GA_ATTRIB_DETAIL, "timing_object_prims", 1, nullptr, nullptr, GA_STORE_INT64));
+  if (pathhandle.isValid())
+    pathhandle.set(GA_Offset(0), paths);
+  if (cookhandle.isValid())
+    cookhandle.set(GA_Offset(0), cooktimes);
+  if (mergehandle.isValid())
+    mergehandle.set(GA_Offset(0), mergetimes);
+  if (primhandle.isValid())
+    primhandle.set(GA_Offset(0), prims);
+  for (const char* name : {"timing_objects", "timing_object_cook_ms", "timing_object_merge_ms", "timing_object_prims"}) {
+    if (GA_Attribute* attr = gdp->findAttribute(GA_ATTRIB_DETAIL, name))
+      attr->bumpDataId();
+  }
 }
 
 
 void SOP_ObjectMerge
-::resolveMaterials(GA_IndexMap::Marker primmarker, OP_Network* objptr, int objindex) {
-  UT_String hintpath;
-  HINTPATH(hintpath);
-  auto matnet = findNode(hintpath);
-  if (matnet)
-    hintpath = UT_String(matnet->getFullPath());
-  formatDirPath(hintpath);
+::updateHiddenParms() {
+  bool enablePathattrib = ENABLEPATHATTRIB();
+  bool resolveMats = RESOLVEMATS();
+  bool enableNodePathattrib = ENABLENODEPATHATTRIB();
   
-  // check if material leads to a valid node.
-  // first we will check at the sop level. If resolution fails, check the object material path.
-  GA_Iterator it;
-  if (objindex == 1) {
-    // for loop doesn't evaluate primmarker on first run. Get global prim iterator instead.
-    it = gdp->getPrimitiveRange().begin();
-  } else {
-    it = primmarker.getRange().begin();
-  }
-  auto handle = GA_RWHandleS(gdp, GA_ATTRIB_PRIMITIVE, "shop_materialpath");
-  if (!handle.isValid()) {
-    auto attr = gdp->addStringTuple(GA_ATTRIB_PRIMITIVE, "shop_materialpath", 1);
-    attr->fill(gdp->getPrimitiveRange(), *it);
-    handle = GA_RWHandleS(gdp, GA_ATTRIB_PRIMITIVE, "shop_materialpath");
-  }
-  if (handle.isValid()) {
-    UT_String matpath;
-    VOP_Node *matnode;
-    auto matnodes = map<UT_String, VOP_Node*>(); // this map guards against redundant searches.
-    
-    UT_String objshoppath{};
-    objptr->getParm("shop_materialpath").getValue(0.0f, objshoppath, 0, true, 0);
-    auto* objmatnode = objptr->findNode(objshoppath);
-    if (objmatnode)
-      objshoppath = objmatnode->getFullPath();
-    
-    for (; !it.atEnd(); ++it) {
-      auto offset = *it;
-      auto shpath = handle->getString(offset, 0);
-      matpath = shpath;
-      auto mapname = UT_String(shpath);
-      if (matnodes.count(mapname) > 0) {
-        // mapname has previously been searched. Skip search, even if value is null.
-        if (matnodes[mapname]) {
-          matnode = matnodes[mapname];
-          handle->setString(offset, matnode->getFullPath());
-        }
-        continue;
-      }
-      if (matpath.length() == 0 && objshoppath.length() > 0) {
-        // uninitialized material path. Use object material path.
-        matpath = objshoppath;
-        if (matpath.length() == 0) continue;
-      }
-      matnode = OPgetDirector()->findVOPNode(matpath);
-      if (matnode) {
-        // matnode has been discovered. Add to map and continue.
-        matnodes[mapname] = matnode;
-        handle->setString(offset, matnode->getFullPath());
-        continue;
-      }
-
-      matpath.prepend(hintpath);
-      matnode = OPgetDirector()->findVOPNode(matpath);
+  this->getParm(parmNames["matnet_hint_path"].getToken()).setVisibleState(resolveMats);
+  this->getParm(parmNames["match_mat_names"].getToken()).setVisibleState(resolveMats);
+  this->getParm(parmNames["pathattrib_name"].getToken()).setVisibleState(enablePathattrib);
+  this->getParm(parmNames["resolve_subnets"].getToken()).setVisibleState(enablePathattrib);
+  this->getParm(parmNames["nodepathattrib_name"].getToken()).setVisibleState(enableNodePathattrib);
+  this->getParm(parmNames["path_encoding"].getToken()).setVisibleState(enablePathattrib || enableNodePathattrib);
+  this->getParm(parmNames["frame_cache_budget"].getToken()).setVisibleState(FRAMECACHE());
 
-      if (matnode) {
-        // matnode has been discovered. Add to map and continue.
-        matnodes[mapname] = matnode;
-        handle->setString(offset, matnode->getFullPath());
-        continue;
-      }
-      matnodes[mapname] = nullptr; // signal that we have searched for mapname but nothing could be found.
-    }
-  }
 }
-
-}
\ No newline at end of file
@@ -17,8 +17,17 @@
 #ifndef ams_sop_objectmerge
 #define ams_sop_objectmerge
 
+#include "ams_utils.h"
+#include "ams_merge.h"
 #include <CH/CH_ExprLanguage.h>
+#include <GU/GU_DetailHandle.h>
 #include <SOP/SOP_Node.h>
+#include <UT/UT_Matrix4.h>
+#include <UT/UT_StringHolder.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 
 namespace ams {
@@ -32,6 +41,9 @@ public:
 
   bool updateParmsFlags() override;
 
+  /** @brief the verb compiled blocks cook. Regular cooks still go through cookMySop. */
+  const SOP_NodeVerb* cookVerb() const override;
+
   static OP_Node* myConstructor(OP_Network* net, const char* name, OP_Operator* entry);
 
   static PRM_Template myTemplateList[];
@@ -50,12 +62,18 @@ public:
   void HINTPATH(UT_String& str) { return evalString(str, "matnet_hint_path", 0, 0.0f); }
   void setHINTPATH(UT_String& str) { setString(str, CH_STRING_LITERAL, "matnet_hint_path", 0, 0.0f); }
 
+  int MATCHMATNAMES() { return evalInt("match_mat_names", 0, 0.0f); }
+  void setMATCHMATNAMES(int val) { setInt("match_mat_names", 0, 0.0f, val); }
+
   int ENABLEPATHATTRIB() { return evalInt("enable_pathattrib", 0, 0.0f); }
   void setENABLEPATHATTRIB(int val) { setInt("enable_pathattrib", 0, 0.0f, val); }
 
   void PATHATTRIBNAME(UT_String& str) { evalString(str, "pathattrib_name", 0, 0.0f); }
   void setPATHATTRIBNAME(UT_String& str) { setString(str, CH_StringMeaning::CH_STRING_LITERAL, "pathattrib_name", 0, 0.0f); }
 
+  int PATHENCODING() { return evalInt("path_encoding", 0, 0.0f); }
+  void setPATHENCODING(int val) { setInt("path_encoding", 0, 0.0f, val); }
+
   int RESOLVESUBNETS() { return evalInt("resolve_subnets", 0, 0.0f); }
   void setRESOLVESUBNETS(int val) { setInt("resolve_subnets", 0, 0.0f, val); }
   
@@ -77,16 +95,141 @@ public:
 
   void XFORMPATH(UT_String& str, fpreal t) { evalString(str, "xformpath", 0, t); }
 
+  void DELETEPOINTATTRIBS(UT_String& str, fpreal t) { evalString(str, "delete_pointattribs", 0, t); }
+  void DELETEVERTEXATTRIBS(UT_String& str, fpreal t) { evalString(str, "delete_vertexattribs", 0, t); }
+  void DELETEPRIMATTRIBS(UT_String& str, fpreal t) { evalString(str, "delete_primattribs", 0, t); }
+  void DELETEDETAILATTRIBS(UT_String& str, fpreal t) { evalString(str, "delete_detailattribs", 0, t); }
+  void DELETEGROUPS(UT_String& str, fpreal t) { evalString(str, "delete_groups", 0, t); }
+
+  int COOKPARALLEL() { return evalInt("cook_parallel", 0, 0.0f); }
+  void setCOOKPARALLEL(int val) { setInt("cook_parallel", 0, 0.0f, val); }
+
+  int NUMRULES() { return evalInt("numrules", 0, 0.0f); }
+  void setNUMRULES(int num_rules) { setInt("numrules", 0, 0.0f, num_rules); }
+
+  void RULEATTRIB(UT_String& str, int i, fpreal t) { evalStringInst("rule_attrib#", &i, str, 0, t); }
+  void RULEPATTERN(UT_String& str, int i, fpreal t) { evalStringInst("rule_pattern#", &i, str, 0, t); }
+  void RULEREPLACE(UT_String& str, int i, fpreal t) { evalStringInst("rule_replace#", &i, str, 0, t); }
+
+  int PACK() { return evalInt("pack", 0, 0.0f); }
+  void setPACK(int val) { setInt("pack", 0, 0.0f, val); }
+
+  int MERGEPARALLEL() { return evalInt("merge_parallel", 0, 0.0f); }
+  void setMERGEPARALLEL(int val) { setInt("merge_parallel", 0, 0.0f, val); }
+
+  int FRAMECACHE() { return evalInt("frame_cache", 0, 0.0f); }
+  void setFRAMECACHE(int val) { setInt("frame_cache", 0, 0.0f, val); }
+
+  fpreal FRAMECACHEBUDGET(fpreal t) { return evalFloat("frame_cache_budget", 0, t); }
+  void setFRAMECACHEBUDGET(fpreal val, fpreal t) { setFloat("frame_cache_budget", 0, t, val); }
+
+  int COOKTIMINGS() { return evalInt("cook_timings", 0, 0.0f); }
+  void setCOOKTIMINGS(int val) { setInt("cook_timings", 0, 0.0f, val); }
+
+  int INCREMENTAL() { return evalInt("incremental", 0, 0.0f); }
+  void setINCREMENTAL(int val) { setInt("incremental", 0, 0.0f, val); }
+
 protected:
+  /** @brief the state of a source as it was last merged into gdp, and the ranges it occupies there. */
+  struct MergedSource {
+    int sopid;
+    /** @brief the unique id of the cooked detail, and the data ids of its topology and primitive list. */
+    exint gdpid;
+    GA_DataId topologyid;
+    GA_DataId primlistid;
+    GA_Offset pointstart, vertexstart, primstart;
+    GA_Size numpoints, numvertices, numprims;
+    UT_Matrix4D xform;
+    UT_StringHolder hierpath;
+    UT_StringHolder nodepath;
+    UT_StringHolder objmaterial;
+    /** @brief data ids of the merged attributes and groups in the cooked detail, keyed by owner and name. */
+    std::map<std::pair<int, std::string>, GA_DataId> attribids;
+    std::map<std::pair<int, std::string>, GA_DataId> groupids;
+  };
+
+  /**
+   * @brief identifies the result of a cook: the cook time, the cooked sources and their transforms.
+   * Animated SOPs renew their data ids whenever they recook, so only frames of static sources match again.
+   */
+  struct FrameKey {
+    fpreal time;
+    /**
+     * @brief per source: the sop unique id, the detail unique id, the topology and primitive list data ids,
+     * and the name hash and data id of every attribute and group.
+     */
+    std::vector<exint> ids;
+    std::vector<UT_Matrix4D> xforms;
+    bool operator==(const FrameKey& other) const {
+      return time == other.time && ids == other.ids && xforms == other.xforms;
+    }
+  };
+
+  /** @brief a cached cook result, and the merged sources it was built from. */
+  struct FrameEntry {
+    GU_DetailHandle gdh;
+    std::vector<MergedSource> merged;
+  };
+
   OP_ERROR cookMySop(OP_Context& context) override;
 
+  void opChanged(OP_EventType reason, void* data) override;
+
+  const ParmSnapshot& parmSnapshot(fpreal t);
+
+  std::vector<OP_Node*> entryNodes(const ObjectEntry& entry);
+
+  /** @brief the options of the merge, which are evaluated on every cook unlike the object entries. */
+  MergeOptions mergeOptions(fpreal t);
+
+  FrameKey frameKey(fpreal t, const std::vector<MergeSource>& sources);
+
+  MergedSource snapshotSource(const MergeSource& source, bool resolve_mats);
+
+  bool updateMergedSources(const std::vector<MergeSource>& sources, const MergeOptions& options);
+
+  void writeCookStats(const std::vector<MergeSource>& sources);
+
   void updateHiddenParms();
-  
-  void resolveMaterials(GA_IndexMap::Marker primmarker, OP_Network* objptr, int objindex=1);
-  
-  std::vector<UT_String> parsePathString(UT_String& str);
 
-  static UT_String resolvePath(const OP_Node& node, bool resolve_subnets=false);
+  std::vector<RewriteRule> getRewriteRules(fpreal t);
+
+  void clearSourcePaths();
+
+  std::vector<OP_Node*> expandPathString(const UT_String& str);
+
+private:
+  /** @brief reports the dependencies and errors of the shared merge steps to the node. */
+  class CookHost;
+
+  /** @brief rebuilt when a parameter, or a node the object paths lead to, changes. */
+  ParmSnapshot myParmSnapshot;
+  /** @brief the snapshot version the objpath# enable states were last applied from. */
+  exint myParmFlagsVersion = 0;
+
+  /** @brief the sources merged by the last cook, in merge order. Empty if gdp must be rebuilt. */
+  std::vector<MergedSource> myMergedSources;
+  /**
+   * @brief the unique id, and topology and primitive list data ids, gdp was left with by the last cook.
+   * Its meta cache count can't tell, as SOP_Node bumps it after every cook.
+   */
+  exint myMergedGdpId = -1;
+  GA_DataId myMergedTopologyId = -1;
+  GA_DataId myMergedPrimListId = -1;
+
+  MergeStats myCookStats;
+
+  /** @brief merged results of recent cooks, until a parameter or a watched node changes. */
+  LRUCache<FrameKey, FrameEntry> myFrameCache;
+
+  /** @brief material lookups shared by all sources and cooks. */
+  MaterialLibrary myMaterials;
+
+  /** @brief the nodes each objpath# pattern expanded to, keyed by the evaluated pattern. */
+  std::unordered_map<std::string, std::vector<OP_Node*>> mySourcePaths;
+  NodeWatcher mySourceWatcher;
+
+  HierarchyPaths myHierPaths;
 };
 
 }
@@ -0,0 +1,349 @@
+/*
+ * Copyright 2021 Anthony Sorge II
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the “Software”), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sop_objectmerge_verb.h"
+#include "sop_objectmerge_verb.proto.h" // generated from theDsFile by houdini_generate_proto_headers
+#include "ams_merge.h"
+#include "ams_utils.h"
+#include <GU/GU_Detail.h>
+#include <DEP/DEP_MicroNode.h>
+#include <OP/OP_Context.h>
+#include <SOP/SOP_Node.h>
+#include <SYS/SYS_SequentialThreadIndex.h>
+#include <UT/UT_WorkArgs.h>
+#include <UT/UT_WorkBuffer.h>
+#include <memory>
+#include <regex>
+#include <vector>
+
+
+namespace ams {
+
+// The parameters the verb reads. Each one must match a parameter of SOP_ObjectMerge::myTemplateList,
+// which the generated struct loads them from.
+static const char* theDsFile = R"THEDSFILE(
+{
+    name        parameters
+    parm {
+        name    "resolve_mats"
+        label   "Resolve Material Paths"
+        type    toggle
+        default { "1" }
+    }
+    parm {
+        name    "matnet_hint_path"
+        label   "Matnet Hint Path"
+        type    string
+        default { "" }
+    }
+    parm {
+        name    "match_mat_names"
+        label   "Match Material Names"
+        type    toggle
+        default { "0" }
+    }
+    parm {
+        name    "enable_pathattrib"
+        label   "Enable Path"
+        type    toggle
+        default { "1" }
+    }
+    parm {
+        name    "pathattrib_name"
+        label   "Path Attribute"
+        type    string
+        default { "path" }
+    }
+    parm {
+        name    "resolve_subnets"
+        label   "Resolve Subnets"
+        type    toggle
+        default { "1" }
+    }
+    parm {
+        name    "enable_nodepathattrib"
+        label   "Enable Node Path"
+        type    toggle
+        default { "1" }
+    }
+    parm {
+        name    "nodepathattrib_name"
+        label   "Node Path Attribute"
+        type    string
+        default { "nodepath" }
+    }
+    parm {
+        name    "path_encoding"
+        label   "Path Encoding"
+        type    ordinal
+        default { "0" }
+        menu {
+            "strings"   "String Attributes"
+            "indexed"   "Index Attributes and Path Tables"
+            "both"      "Both"
+        }
+    }
+    parm {
+        name    "xformpath"
+        label   "Transform Object"
+        type    oppath
+        default { "" }
+        parmtag { "opfilter" "!!OBJ!!" }
+        parmtag { "oprelative" "." }
+    }
+    parm {
+        name    "delete_pointattribs"
+        label   "Delete Point Attributes"
+        type    string
+        default { "" }
+    }
+    parm {
+        name    "delete_vertexattribs"
+        label   "Delete Vertex Attributes"
+        type    string
+        default { "" }
+    }
+    parm {
+        name    "delete_primattribs"
+        label   "Delete Primitive Attributes"
+        type    string
+        default { "" }
+    }
+    parm {
+        name    "delete_detailattribs"
+        label   "Delete Detail Attributes"
+        type    string
+        default { "" }
+    }
+    parm {
+        name    "delete_groups"
+        label   "Delete Groups"
+        type    string
+        default { "" }
+    }
+    parm {
+        name    "cook_parallel"
+        label   "Cook Objects in Parallel"
+        type    toggle
+        default { "0" }
+    }
+    parm {
+        name    "merge_parallel"
+        label   "Merge Objects in Parallel"
+        type    toggle
+        default { "0" }
+    }
+    parm {
+        name    "pack"
+        label   "Pack Geometry Before Merging"
+        type    toggle
+        default { "0" }
+    }
+    multiparm {
+        name    "numrules"
+        label   "Rewrite Rules"
+        default 0
+        parmtag { "multistartoffset" "1" }
+        parm {
+            name    "rule_attrib#"
+            label   "Attributes #"
+            type    string
+            default { "path" }
+        }
+        parm {
+            name    "rule_pattern#"
+            label   "Pattern #"
+            type    string
+            default { "" }
+        }
+        parm {
+            name    "rule_replace#"
+            label   "Replace #"
+            type    string
+            default { "" }
+        }
+    }
+    multiparm {
+        name    "numobj"
+        label   "Number of Objects"
+        default 1
+        parmtag { "multistartoffset" "1" }
+        parm {
+            name    "enable#"
+            label   "Enable Merge #"
+            type    toggle
+            default { "1" }
+        }
+        parm {
+            name    "objpath#"
+            label   "Object #"
+            type    oppath
+            default { "" }
+            parmtag { "oprelative" "." }
+        }
+    }
+}
+)THEDSFILE";
+
+// Never destroyed, as their watchers may still be registered with nodes when the process exits.
+// Compiled blocks cook the verb on many threads at once; both caches lock themselves.
+static HierarchyPaths& verbHierarchyPaths() {
+  static HierarchyPaths* paths = new HierarchyPaths();
+  return *paths;
+}
+
+static MaterialLibrary& verbMaterials() {
+  static MaterialLibrary* materials = new MaterialLibrary();
+  return *materials;
+}
+
+
+// Reports the dependencies and errors of a verb cook. Paths are relative to the node being cooked,
+// wherever the verb runs, and are expanded anew on every cook, as the verb keeps no state of its own.
+class VerbHost : public MergeHost {
+public:
+  VerbHost(const SOP_NodeVerb::CookParms& cookparms, OP_Node* cwd) : myCookParms(cookparms), myCwd(cwd) {}
+
+  OP_Node* node() override { return myCwd; }
+
+  std::vector<OP_Node*> entryNodes(const ObjectEntry& entry) override {
+    std::vector<OP_Node*> nodes;
+    UT_String pattern(UT_String::ALWAYS_DEEP, entry.path.c_str());
+    UT_WorkArgs paths;
+    pattern.tokenize(paths, ' ');
+    for (auto* path : paths) {
+      UT_String expanded;
+      UT_ValArray<OP_Node*> matches;
+      myCwd->globNodes(path, &expanded, &matches);
+      for (OP_Node* node : matches)
+        nodes.push_back(node);
+    }
+    return nodes;
+  }
+
+  void addDependency(OP_Node* node, OP_InterestType type) override {
+    if (myCookParms.depnode())
+      myCookParms.depnode()->addExplicitInput(node->dataMicroNode());
+  }
+
+  void addWarning(SOP_ErrorCodes code, const char* msg) override { myCookParms.sopAddWarning(code, msg); }
+
+  void addError(SOP_ErrorCodes code, const char* msg) override { myCookParms.sopAddError(code, msg); }
+
+  void addTransformError(const OP_Node& node, const char* label) override {
+    UT_WorkBuffer msg;
+    msg.sprintf("Unable to evaluate the %s transform of %s", label, node.getFullPath().c_str());
+    myCookParms.sopAddError(SOP_MESSAGE, msg.buffer());
+  }
+
+  HierarchyPaths& hierarchyPaths() override { return verbHierarchyPaths(); }
+
+  MaterialLibrary& materials() override { return verbMaterials(); }
+
+private:
+  const SOP_NodeVerb::CookParms& myCookParms;
+  OP_Node* myCwd;
+};
+
+
+// Evaluates the parameters of the verb the way the node evaluates its own.
+static ParmSnapshot verbSnapshot(const sop_objectmerge_verbParms& parms, const SOP_NodeVerb::CookParms& cookparms) {
+  ParmSnapshot snapshot;
+  snapshot.valid = true;
+  snapshot.time = cookparms.getCookTime();
+  int objindex = 1;
+  for (const auto& entry : parms.getNumobj()) {
+    bool bundle = entry.objpath.findChar('@') != nullptr;
+    snapshot.entries.push_back({objindex++, entry.enable, entry.objpath, bundle, {}});
+  }
+
+  MergeOptions& options = snapshot.options;
+  options.pack = parms.getPack();
+  options.cookparallel = parms.getCook_parallel();
+  options.mergeparallel = parms.getMerge_parallel();
+  options.resolvemats = parms.getResolve_mats();
+  options.hintpath = parms.getMatnet_hint_path();
+  options.matchnames = parms.getMatch_mat_names();
+  options.enablepathattrib = parms.getEnable_pathattrib();
+  options.pathattrib = parms.getPathattrib_name();
+  options.resolvesubnets = parms.getResolve_subnets();
+  options.enablenodepathattrib = parms.getEnable_nodepathattrib();
+  options.nodepathattrib = parms.getNodepathattrib_name();
+  options.pathencoding = int(parms.getPath_encoding());
+  options.xformpath = parms.getXformpath();
+  options.filter.attribs[GA_ATTRIB_POINT].harden(parms.getDelete_pointattribs().c_str());
+  options.filter.attribs[GA_ATTRIB_VERTEX].harden(parms.getDelete_vertexattribs().c_str());
+  options.filter.attribs[GA_ATTRIB_PRIMITIVE].harden(parms.getDelete_primattribs().c_str());
+  options.filter.attribs[GA_ATTRIB_DETAIL].harden(parms.getDelete_detailattribs().c_str());
+  options.filter.groups.harden(parms.getDelete_groups().c_str());
+  for (const auto& rule : parms.getNumrules()) {
+    if (!rule.rule_attrib.isstring() || !rule.rule_pattern.isstring())
+      continue;
+    try {
+      options.rules.push_back({rule.rule_attrib, std::make_shared<CompiledReplace>(rule.rule_pattern.toStdString(),
+                                                                                    rule.rule_replace.toStdString())});
+    } catch (const std::regex_error& e) {
+      UT_WorkBuffer msg;
+      msg.sprintf("Invalid rewrite pattern '%s': %s", rule.rule_pattern.c_str(), e.what());
+      cookparms.sopAddWarning(SOP_MESSAGE, msg.buffer());
+    }
+  }
+  return snapshot;
+}
+
+
+class SOP_ObjectMergeVerb : public SOP_NodeVerb {
+public:
+  SOP_NodeParms* allocParms() const override { return new sop_objectmerge_verbParms(); }
+  UT_StringHolder name() const override { return theSOPTypeName; }
+  CookMode cookMode(const SOP_NodeParms* parms) const override { return COOK_GENERIC; }
+  void cook(const CookParms& cookparms) const override;
+
+  static const UT_StringHolder theSOPTypeName;
+  static const SOP_NodeVerb::Register<SOP_ObjectMergeVerb> theVerb;
+};
+
+const UT_StringHolder SOP_ObjectMergeVerb::theSOPTypeName("ams::objectmerge::1.0");
+const SOP_NodeVerb::Register<SOP_ObjectMergeVerb> SOP_ObjectMergeVerb::theVerb;
+
+
+const SOP_NodeVerb* objectMergeVerb() {
+  return SOP_ObjectMergeVerb::theVerb.get();
+}
+
+
+void SOP_ObjectMergeVerb
+::cook(const CookParms& cookparms) const {
+  auto&& parms = cookparms.parms<sop_objectmerge_verbParms>();
+  GU_Detail* gdp = cookparms.gdh().gdpNC();
+  // Paths are relative to the node being cooked, wherever the verb runs.
+  OP_Node* cwd = cookparms.getCwd();
+  if (!cwd) {
+    gdp->clearAndDestroy();
+    return;
+  }
+  OP_Context context(cookparms.getCookTime());
+  context.setThread(SYSgetSTID());
+
+  // The same steps as a regular cook of the node, without the state it keeps between cooks.
+  ParmSnapshot snapshot = verbSnapshot(parms, cookparms);
+  VerbHost host(cookparms, cwd);
+  MergeStats stats;
+  mergeObjects(*gdp, snapshot, host, context, stats);
+  cookparms.select(GA_GROUP_PRIMITIVE);
+}
+
+}
@@ -0,0 +1,518 @@
+// Benchmarks of the object merge. Synthetic sources are cooked by a small benchmark SOP inside a
+// standalone director, merged by an AMS Object Merge with different options, and the timings are
+// printed as one JSON object per line, e.g.:
+//   {"benchmark": "merge", "iterations": 20, "mean_ms": 12.5, "min_ms": 11.9, "max_ms": 14.2, ...}
+// The phases of a cook (hierarchy paths, path attribute fills, material resolution, rewrites) are also
+// timed on their own.
+//
+// Usage: bench_hams [--sources N] [--rows N] [--attribs N] [--materials N] [--depth N] [--iterations N]
+
+#include "../src/sop_objectmerge.h"
+#include "../src/ams_merge.h"
+#include "../src/ams_utils.h"
+#include <GU/GU_Detail.h>
+#include <GA/GA_Handle.h>
+#include <GA/GA_Iterator.h>
+#include <GA/GA_PolyCounts.h>
+#include <GA/GA_PrimitiveTypes.h>
+#include <GEO/GEO_PrimPoly.h>
+#include <MOT/MOT_Director.h>
+#include <OP/OP_Director.h>
+#include <OP/OP_Operator.h>
+#include <OP/OP_OperatorTable.h>
+#include <PI/PI_ResourceManager.h>
+#include <PRM/PRM_Include.h>
+#include <SOP/SOP_Node.h>
+#include <UT/UT_StopWatch.h>
+#include <UT/UT_WorkBuffer.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+void newSopOperator(OP_OperatorTable* table);
+
+
+struct BenchConfig {
+  int sources = 50;
+  /** @brief each source is a grid of rows x rows quads. */
+  int rows = 100;
+  /** @brief the number of extra float point attributes of each source. */
+  int attribs = 4;
+  /** @brief the number of distinct shop_materialpath values of each source. */
+  int materials = 16;
+  /** @brief the number of null objects each source object is parented under. */
+  int depth = 8;
+  int iterations = 20;
+};
+
+
+/**
+ * @brief generates a grid with point normals, extra point attributes and material paths.
+ * Bumping the version parameter only rewrites the values of attrib0, keeping the topology and the
+ * data ids of everything else, like an upstream deformer which changes one attribute.
+ */
+class SOP_BenchSource : public SOP_Node {
+public:
+  static OP_Node* myConstructor(OP_Network* net, const char* name, OP_Operator* entry) {
+    return new SOP_BenchSource(net, name, entry);
+  }
+  static PRM_Template myTemplateList[];
+
+protected:
+  SOP_BenchSource(OP_Network* net, const char* name, OP_Operator* entry) : SOP_Node(net, name, entry) {
+    mySopFlags.setManagesDataIDs(true);
+  }
+
+  OP_ERROR cookMySop(OP_Context& context) override {
+    fpreal t = context.getTime();
+    int rows = SYSmax(evalInt("rows", 0, t), 1);
+    int attribs = evalInt("attribs", 0, t);
+    int materials = SYSmax(evalInt("materials", 0, t), 1);
+    int version = evalInt("version", 0, t);
+    if (rows == myRows && attribs == myAttribs && materials == myMaterials
+        && gdp->getNumPoints() == (rows + 1) * (rows + 1)) {
+      GA_RWHandleV3 handle(gdp->findPointAttribute("attrib0"));
+      if (handle.isValid()) {
+        for (GA_Iterator it(gdp->getPointRange()); !it.atEnd(); ++it)
+          handle.set(*it, UT_Vector3(0, gdp->pointIndex(*it), version));
+        handle.bumpDataId();
+      }
+      return error();
+    }
+    myRows = rows;
+    myAttribs = attribs;
+    myMaterials = materials;
+    gdp->clearAndDestroy();
+    GA_Offset ptstart = gdp->appendPointBlock((rows + 1) * (rows + 1));
+    GA_RWHandleV3 normals(gdp->addNormalAttribute(GA_ATTRIB_POINT));
+    for (GA_Size i = 0; i < (rows + 1) * (rows + 1); i++) {
+      GA_Offset ptoff = ptstart + i;
+      gdp->setPos3(ptoff, UT_Vector3(i % (rows + 1), 0, i / (rows + 1)));
+      normals.set(ptoff, UT_Vector3(0, 1, 0));
+    }
+    for (int a = 0; a < attribs; a++) {
+      UT_WorkBuffer name;
+      name.sprintf("attrib%d", a);
+      GA_RWHandleV3 handle(gdp->addFloatTuple(GA_ATTRIB_POINT, name.buffer(), 3));
+      for (GA_Size i = 0; i < (rows + 1) * (rows + 1); i++)
+        handle.set(ptstart + i, UT_Vector3(a, i, 0));
+    }
+    GA_PolyCounts sizes;
+    sizes.append(4, rows * rows);
+    UT_IntArray ptnums;
+    for (int r = 0; r < rows; r++) {
+      for (int c = 0; c < rows; c++) {
+        int pt = r * (rows + 1) + c;
+        ptnums.append(pt);
+        ptnums.append(pt + 1);
+        ptnums.append(pt + rows + 2);
+        ptnums.append(pt + rows + 1);
+      }
+    }
+    GA_Offset primstart = GEO_PrimPoly::buildBlock(gdp, ptstart, (rows + 1) * (rows + 1), sizes, ptnums.array(), true);
+    GA_RWHandleS matpaths(gdp->addStringTuple(GA_ATTRIB_PRIMITIVE, "shop_materialpath", 1));
+    for (GA_Size i = 0; i < rows * rows; i++) {
+      UT_WorkBuffer path;
+      path.sprintf("/mat/bench%d", int(i % materials));
+      matpaths.set(primstart + i, path.buffer());
+    }
+    gdp->bumpAllDataIds();
+    return error();
+  }
+
+private:
+  int myRows = -1, myAttribs = -1, myMaterials = -1;
+};
+
+static PRM_Name benchSourceNames[] = {
+  PRM_Name("rows", "Rows"),
+  PRM_Name("attribs", "Attributes"),
+  PRM_Name("materials", "Materials"),
+  PRM_Name("version", "Version"),
+};
+
+PRM_Template SOP_BenchSource::myTemplateList[] = {
+  PRM_Template(PRM_INT, 1, &benchSourceNames[0], PRMoneDefaults),
+  PRM_Template(PRM_INT, 1, &benchSourceNames[1], PRMzeroDefaults),
+  PRM_Template(PRM_INT, 1, &benchSourceNames[2], PRMoneDefaults),
+  PRM_Template(PRM_INT, 1, &benchSourceNames[3], PRMzeroDefaults),
+  PRM_Template()
+};
+
+
+struct BenchScene {
+  std::vector<SOP_Node*> sources;
+  /** @brief the null the merge is made relative to by the transform benchmarks. */
+  OP_Node* xform;
+  ams::SOP_ObjectMerge* merge;
+};
+
+
+static BenchScene buildScene(const BenchConfig& config) {
+  OP_Director* director = OPgetDirector();
+  OP_Network* obj = (OP_Network*) director->findNode("/obj");
+  OP_Network* mat = (OP_Network*) director->findNode("/mat");
+  for (int m = 0; m < config.materials; m++) {
+    UT_WorkBuffer name;
+    name.sprintf("bench%d", m);
+    if (mat)
+      mat->createNode("principledshader::2.0", name.buffer());
+  }
+  OP_Node* xform = obj->createNode("null", "xform");
+
+  // Every source object sits at the bottom of its own chain of nulls, so its hierarchy path is deep.
+  BenchScene scene;
+  scene.xform = xform;
+  for (int s = 0; s < config.sources; s++) {
+    OP_Node* parent = nullptr;
+    for (int d = 0; d < config.depth; d++) {
+      UT_WorkBuffer name;
+      name.sprintf("chain%d_%d", s, d);
+      OP_Node* null = obj->createNode("null", name.buffer());
+      if (parent)
+        null->setInput(0, parent);
+      parent = null;
+    }
+    UT_WorkBuffer name;
+    name.sprintf("source%d", s);
+    OP_Network* geo = (OP_Network*) obj->createNode("geo", name.buffer());
+    if (parent)
+      geo->setInput(0, parent);
+    SOP_Node* sop = (SOP_Node*) geo->createNode("ams_bench_source", "src");
+    sop->setInt("rows", 0, 0.0f, config.rows);
+    sop->setInt("attribs", 0, 0.0f, config.attribs);
+    sop->setInt("materials", 0, 0.0f, config.materials);
+    sop->setDisplay(true);
+    scene.sources.push_back(sop);
+  }
+  OP_Network* out = (OP_Network*) obj->createNode("geo", "merged");
+  scene.merge = (ams::SOP_ObjectMerge*) out->createNode("ams::objectmerge::1.0", "merge");
+  UT_String pattern("/obj/source*");
+  scene.merge->setNUMOBJ(1);
+  scene.merge->setSOPPATH(pattern, CH_STRING_LITERAL, 1, 0.0f);
+  return scene;
+}
+
+
+/** @brief sets the options of the merge back to a plain merge, without tagging, materials or caching. */
+static void resetMerge(ams::SOP_ObjectMerge* merge) {
+  UT_String empty("");
+  merge->setString(empty, CH_STRING_LITERAL, "xformpath", 0, 0.0f);
+  merge->setENABLEPATHATTRIB(0);
+  merge->setENABLENODEPATHATTRIB(0);
+  merge->setRESOLVEMATS(0);
+  merge->setINCREMENTAL(0);
+  merge->setMERGEPARALLEL(0);
+  merge->setCOOKPARALLEL(0);
+  merge->setPACK(0);
+  merge->setFRAMECACHE(0);
+  merge->setCOOKTIMINGS(0);
+}
+
+
+/** @param extra more JSON members to print, e.g. "\"incremental_cooks\": 20". */
+static void report(const char* benchmark, const BenchConfig& config, std::vector<double> times, exint items,
+                   const std::string& extra = std::string()) {
+  std::sort(times.begin(), times.end());
+  double total = 0;
+  for (double time : times)
+    total += time;
+  printf("{\"benchmark\": \"%s\", \"iterations\": %d, \"mean_ms\": %.4f, \"min_ms\": %.4f, \"median_ms\": %.4f, "
+         "\"max_ms\": %.4f, \"items\": %lld, \"sources\": %d, \"rows\": %d, \"attribs\": %d, \"materials\": %d, "
+         "\"depth\": %d%s%s}\n",
+         benchmark, (int) times.size(), total / times.size(), times.front(), times[times.size() / 2], times.back(),
+         (long long) items, config.sources, config.rows, config.attribs, config.materials, config.depth,
+         extra.empty() ? "" : ", ", extra.c_str());
+  fflush(stdout);
+}
+
+
+/**
+ * @brief cooks the merge once to warm up, then times every forced recook.
+ * @param touch called before each timed cook, e.g. to change one source.
+ */
+static void benchMerge(const char* benchmark, const BenchConfig& config, BenchScene& scene,
+                       const std::function<void(int)>& touch = nullptr) {
+  OP_Context context(0.0f);
+  scene.merge->getCookedGeo(context);
+  std::vector<double> times;
+  exint prims = 0;
+  // With cook timings on, the merge reports whether each cook updated its sources in place.
+  int incremental = -1;
+  for (int i = 0; i < config.iterations; i++) {
+    if (touch)
+      touch(i);
+    else
+      scene.merge->forceRecook();
+    UT_StopWatch timer;
+    timer.start();
+    const GU_Detail* geo = scene.merge->getCookedGeo(context);
+    times.push_back(timer.lap() * 1000.0);
+    prims = geo ? geo->getNumPrimitives() : 0;
+    GA_ROHandleI updated(geo ? geo->findAttribute(GA_ATTRIB_DETAIL, "timing_incremental") : nullptr);
+    if (updated.isValid())
+      incremental = SYSmax(incremental, 0) + updated.get(GA_Offset(0));
+  }
+  std::string extra;
+  if (incremental >= 0)
+    extra = "\"incremental_cooks\": " + std::to_string(incremental);
+  report(benchmark, config, times, prims, extra);
+}
+
+
+static void benchReplace(const BenchConfig& config) {
+  // One string per prim of every source, as the path rewrite rules would see them.
+  std::vector<std::string> paths;
+  exint count = (exint) config.sources * config.rows * config.rows;
+  paths.reserve(count);
+  for (exint i = 0; i < count; i++) {
+    std::string path = "/obj";
+    for (int d = 0; d < config.depth; d++)
+      path += "/chain" + std::to_string(i % config.sources) + "_" + std::to_string(d);
+    paths.push_back(path + "/source" + std::to_string(i % config.sources));
+  }
+  std::vector<double> times;
+  for (int i = 0; i < config.iterations; i++) {
+    UT_StopWatch timer;
+    timer.start();
+    size_t size = 0;
+    for (const std::string& path : paths)
+      size += ams::re_replace(path, "/chain(\\d+)_\\d+", "/~1").size();
+    times.push_back(timer.lap() * 1000.0);
+    if (size == 0)
+      std::cerr << "re_replace produced no output" << std::endl;
+  }
+  report("re_replace", config, times, count);
+  times.clear();
+  ams::CompiledReplace program("/chain(\\d+)_\\d+", "/~1");
+  for (int i = 0; i < config.iterations; i++) {
+    UT_StopWatch timer;
+    timer.start();
+    size_t size = 0;
+    for (const std::string& path : paths)
+      size += program(path).size();
+    times.push_back(timer.lap() * 1000.0);
+    if (size == 0)
+      std::cerr << "CompiledReplace produced no output" << std::endl;
+  }
+  report("compiled_replace", config, times, count);
+}
+
+
+// The paths of the source objects, as the path attribute holds them.
+static void benchHierarchyPaths(const BenchConfig& config, const BenchScene& scene) {
+  std::vector<OP_Node*> objects;
+  for (SOP_Node* sop : scene.sources)
+    objects.push_back(sop->getCreator());
+  auto resolveAll = [&objects](ams::HierarchyPaths& paths) {
+    exint length = 0;
+    for (OP_Node* object : objects)
+      length += paths.path(*object, false).length();
+    return length;
+  };
+  // Cold lookups walk the whole chain of every object. Warm lookups are answered from the cache.
+  std::vector<double> times;
+  for (int i = 0; i < config.iterations; i++) {
+    ams::HierarchyPaths paths;
+    UT_StopWatch timer;
+    timer.start();
+    resolveAll(paths);
+    times.push_back(timer.lap() * 1000.0);
+  }
+  report("hierarchy_paths_cold", config, times, (exint) objects.size());
+  times.clear();
+  ams::HierarchyPaths paths;
+  resolveAll(paths);
+  for (int i = 0; i < config.iterations; i++) {
+    UT_StopWatch timer;
+    timer.start();
+    resolveAll(paths);
+    times.push_back(timer.lap() * 1000.0);
+  }
+  report("hierarchy_paths_warm", config, times, (exint) objects.size());
+}
+
+
+// Tags one range of primitives per source, with both encodings of the path attributes.
+static void benchPathFills(const BenchConfig& config) {
+  GA_Size perSource = (GA_Size) config.rows * config.rows;
+  GU_Detail geo;
+  GA_Offset primstart = geo.appendPrimitiveBlock(GA_PRIMPOLY, perSource * config.sources);
+  std::vector<GA_Range> ranges;
+  std::vector<std::string> paths, nodepaths;
+  for (int s = 0; s < config.sources; s++) {
+    GA_Offset start = primstart + s * perSource;
+    ranges.emplace_back(geo.getPrimitiveMap(), start, start + perSource);
+    std::string path = "/obj";
+    for (int d = 0; d < config.depth; d++)
+      path += "/chain" + std::to_string(s) + "_" + std::to_string(d);
+    paths.push_back(path + "/source" + std::to_string(s));
+    nodepaths.push_back("/obj/source" + std::to_string(s) + "/src");
+  }
+  exint prims = geo.getNumPrimitives();
+
+  std::vector<double> times;
+  for (int i = 0; i < config.iterations; i++) {
+    UT_StopWatch timer;
+    timer.start();
+    GA_Attribute* path = ams::primStringAttribute(geo, "path");
+    GA_Attribute* nodepath = ams::primStringAttribute(geo, "nodepath");
+    for (int s = 0; s < config.sources; s++) {
+      ams::fillStringAttribute(path, ranges[s], paths[s].c_str());
+      ams::fillStringAttribute(nodepath, ranges[s], nodepaths[s].c_str());
+    }
+    times.push_back(timer.lap() * 1000.0);
+  }
+  report("fill_path_strings", config, times, prims);
+  times.clear();
+  for (int i = 0; i < config.iterations; i++) {
+    UT_StopWatch timer;
+    timer.start();
+    GA_Attribute* path = ams::primIndexAttribute(geo, ams::indexAttribName("path"));
+    GA_Attribute* nodepath = ams::primIndexAttribute(geo, ams::indexAttribName("nodepath"));
+    for (int s = 0; s < config.sources; s++) {
+      ams::fillIndexAttribute(path, ranges[s], s);
+      ams::fillIndexAttribute(nodepath, ranges[s], s);
+    }
+    times.push_back(timer.lap() * 1000.0);
+  }
+  report("fill_path_indices", config, times, prims);
+}
+
+
+// Resolves the materials of each source's primitives within a plain merge of the scene.
+static void benchResolveMaterials(const BenchConfig& config, BenchScene& scene) {
+  resetMerge(scene.merge);
+  OP_Context context(0.0f);
+  const GU_Detail* merged = scene.merge->getCookedGeo(context);
+  GA_Size perSource = (GA_Size) config.rows * config.rows;
+  if (!merged || !merged->getPrimitiveMap().isTrivialMap()
+      || merged->getNumPrimitives() != perSource * config.sources) {
+    std::cerr << "resolveMaterials benchmark skipped: the merge isn't laid out per source" << std::endl;
+    return;
+  }
+  auto resolveAll = [&](GU_Detail& geo, ams::MaterialLibrary& materials) {
+    UT_StringHolder hintpath = materials.resolveHintPath(scene.merge, UT_StringHolder("/mat"));
+    for (int s = 0; s < config.sources; s++) {
+      GA_Range range(geo.getPrimitiveMap(), GA_Offset(s * perSource), GA_Offset((s + 1) * perSource));
+      ams::resolveMaterials(geo, range, *scene.sources[s]->getCreator(), materials, hintpath, false);
+    }
+  };
+  // Every iteration starts from the merged paths. Cold lookups search and index the matnet,
+  // warm lookups are answered from the cache.
+  std::vector<double> times;
+  for (int i = 0; i < config.iterations; i++) {
+    GU_Detail geo;
+    geo.replaceWith(*merged);
+    ams::MaterialLibrary materials;
+    UT_StopWatch timer;
+    timer.start();
+    resolveAll(geo, materials);
+    times.push_back(timer.lap() * 1000.0);
+  }
+  report("resolve_materials_cold", config, times, merged->getNumPrimitives());
+  times.clear();
+  ams::MaterialLibrary materials;
+  {
+    GU_Detail geo;
+    geo.replaceWith(*merged);
+    resolveAll(geo, materials);
+  }
+  for (int i = 0; i < config.iterations; i++) {
+    GU_Detail geo;
+    geo.replaceWith(*merged);
+    UT_StopWatch timer;
+    timer.start();
+    resolveAll(geo, materials);
+    times.push_back(timer.lap() * 1000.0);
+  }
+  report("resolve_materials_warm", config, times, merged->getNumPrimitives());
+}
+
+
+static BenchConfig parseArgs(int argc, char* argv[]) {
+  BenchConfig config;
+  std::map<std::string, int*> options = {
+    {"--sources", &config.sources}, {"--rows", &config.rows}, {"--attribs", &config.attribs},
+    {"--materials", &config.materials}, {"--depth", &config.depth}, {"--iterations", &config.iterations}
+  };
+  for (int i = 1; i + 1 < argc; i += 2) {
+    auto option = options.find(argv[i]);
+    if (option == options.end()) {
+      std::cerr << "unknown option " << argv[i] << std::endl;
+      std::exit(1);
+    }
+    *option->second = std::max(std::atoi(argv[i + 1]), 0);
+  }
+  config.iterations = std::max(config.iterations, 1);
+  config.sources = std::max(config.sources, 1);
+  // The incremental benchmark changes attrib0 of one source.
+  config.attribs = std::max(config.attribs, 1);
+  return config;
+}
+
+
+int main(int argc, char* argv[]) {
+  BenchConfig config = parseArgs(argc, argv);
+
+  MOT_Director* director = new MOT_Director("bench_hams");
+  OPsetDirector(director);
+  PIcreateResourceManager();
+  OP_OperatorTable* table = OP_Network::getOperatorTable(SOP_TABLE_NAME);
+  newSopOperator(table);
+  table->addOperator(new OP_Operator("ams_bench_source", "AMS Bench Source", SOP_BenchSource::myConstructor,
+                                     SOP_BenchSource::myTemplateList, 0, 0, 0, OP_FLAG_GENERATOR));
+
+  BenchScene scene = buildScene(config);
+  ams::SOP_ObjectMerge* merge = scene.merge;
+
+  resetMerge(merge);
+  benchMerge("merge", config, scene);
+
+  UT_String xformpath("/obj/xform");
+  merge->setString(xformpath, CH_STRING_LITERAL, "xformpath", 0, 0.0f);
+  benchMerge("merge_transform", config, scene);
+
+  resetMerge(merge);
+  merge->setMERGEPARALLEL(1);
+  benchMerge("merge_parallel", config, scene);
+
+  resetMerge(merge);
+  merge->setENABLEPATHATTRIB(1);
+  merge->setENABLENODEPATHATTRIB(1);
+  benchMerge("path_attributes", config, scene);
+
+  resetMerge(merge);
+  merge->setRESOLVEMATS(1);
+  benchMerge("resolve_materials", config, scene);
+
+  // Only one attribute of one source changes between cooks, which the incremental update recopies in place.
+  // incremental_cooks counts the timed cooks which took that path, and should equal iterations.
+  resetMerge(merge);
+  merge->setINCREMENTAL(1);
+  merge->setCOOKTIMINGS(1);
+  benchMerge("incremental_one_source", config, scene, [&scene](int i) {
+    scene.sources[i % scene.sources.size()]->setInt("version", 0, 0.0f, i + 1);
+  });
+
+  // Only the transform the merge is made relative to changes, which retransforms every source in place.
+  merge->setString(xformpath, CH_STRING_LITERAL, "xformpath", 0, 0.0f);
+  benchMerge("incremental_transform", config, scene, [&scene](int i) {
+    scene.xform->setFloat("t", 0, 0.0f, i + 1);
+  });
+
+  // The phases of a cook, on their own.
+  benchHierarchyPaths(config, scene);
+  benchPathFills(config);
+  benchResolveMaterials(config, scene);
+  benchReplace(config);
+  return 0;
+}
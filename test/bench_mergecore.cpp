@@ -0,0 +1,155 @@
+// Benchmarks of the merge core on synthetic grids. Unlike bench_hams, nothing here needs Houdini, so
+// it runs on any machine. Timings are printed as one JSON object per line, like bench_hams:
+//   {"benchmark": "merge_parallel", "iterations": 20, "mean_ms": 3.1, "min_ms": 2.9, ...}
+//
+// Usage: bench_mergecore [--sources N] [--rows N] [--attribs N] [--materials N] [--iterations N]
+
+#include "../src/ams_mergecore.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+
+using namespace ams::core;
+
+struct BenchConfig {
+  int sources = 200;
+  /** @brief each source is a grid of rows x rows quads. */
+  int rows = 100;
+  /** @brief the number of extra float point attributes of each source. */
+  int attribs = 4;
+  /** @brief the number of distinct shop_materialpath values of each source. */
+  int materials = 16;
+  int iterations = 20;
+};
+
+
+static Geometry makeSource(const BenchConfig& config, int index) {
+  Geometry geo;
+  int rows = std::max(config.rows, 1);
+  geo.numpoints = (size_t) (rows + 1) * (rows + 1);
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < rows; c++) {
+      int64_t p = r * (rows + 1) + c;
+      geo.appendPolygon({p, p + 1, p + rows + 2, p + rows + 1});
+    }
+  }
+  geo.addFloat(POINT, "P", 3, TypeInfo::POINT);
+  geo.addFloat(POINT, "N", 3, TypeInfo::NORMAL);
+  for (int a = 0; a < config.attribs; a++)
+    geo.addFloat(POINT, "attrib" + std::to_string(a), 1);
+  FloatAttribute& P = *geo.findFloat(POINT, "P");
+  FloatAttribute& N = *geo.findFloat(POINT, "N");
+  for (size_t i = 0; i < geo.numpoints; i++) {
+    P.components[0][i] = (float) (i % (rows + 1)) + index;
+    P.components[2][i] = (float) (i / (rows + 1));
+    N.components[1][i] = 1.0f;
+  }
+  StringAttribute& mats = geo.addString(PRIMITIVE, "shop_materialpath");
+  for (size_t i = 0; i < geo.numPrimitives(); i++)
+    mats.indices[i] = mats.add("mat" + std::to_string(i % std::max(config.materials, 1)));
+  return geo;
+}
+
+
+static void report(const char* benchmark, const BenchConfig& config, std::vector<double> times, long long items) {
+  std::sort(times.begin(), times.end());
+  double total = 0;
+  for (double time : times)
+    total += time;
+  printf("{\"benchmark\": \"%s\", \"iterations\": %d, \"mean_ms\": %.4f, \"min_ms\": %.4f, \"median_ms\": %.4f, "
+         "\"max_ms\": %.4f, \"items\": %lld, \"sources\": %d, \"rows\": %d, \"attribs\": %d, \"materials\": %d}\n",
+         benchmark, (int) times.size(), total / times.size(), times.front(), times[times.size() / 2], times.back(),
+         items, config.sources, config.rows, config.attribs, config.materials);
+  fflush(stdout);
+}
+
+
+/**
+ * @brief times a step of the merge on a freshly merged geometry.
+ * @param step the timed work. Returns the number of items it processed.
+ */
+static void bench(const char* benchmark, const BenchConfig& config, const std::vector<const Geometry*>& sources,
+                  const std::function<long long(Geometry&, const MergePlan&)>& step) {
+  std::vector<double> times;
+  long long items = 0;
+  for (int i = 0; i < config.iterations; i++) {
+    Geometry merged;
+    MergePlan plan = mergeGeometry(merged, sources, true);
+    auto start = std::chrono::steady_clock::now();
+    items = step(merged, plan);
+    times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  report(benchmark, config, times, items);
+}
+
+
+static BenchConfig parseArgs(int argc, char* argv[]) {
+  BenchConfig config;
+  std::map<std::string, int*> options = {
+    {"--sources", &config.sources}, {"--rows", &config.rows}, {"--attribs", &config.attribs},
+    {"--materials", &config.materials}, {"--iterations", &config.iterations}
+  };
+  for (int i = 1; i + 1 < argc; i += 2) {
+    auto option = options.find(argv[i]);
+    if (option == options.end()) {
+      std::cerr << "unknown option " << argv[i] << std::endl;
+      std::exit(1);
+    }
+    *option->second = std::max(std::atoi(argv[i + 1]), 0);
+  }
+  config.iterations = std::max(config.iterations, 1);
+  config.sources = std::max(config.sources, 1);
+  return config;
+}
+
+
+int main(int argc, char* argv[]) {
+  BenchConfig config = parseArgs(argc, argv);
+  std::vector<Geometry> geometry;
+  for (int i = 0; i < config.sources; i++)
+    geometry.push_back(makeSource(config, i));
+  std::vector<const Geometry*> sources;
+  for (const Geometry& geo : geometry)
+    sources.push_back(&geo);
+
+  for (bool parallel : {false, true}) {
+    std::vector<double> times;
+    long long prims = 0;
+    for (int i = 0; i < config.iterations; i++) {
+      Geometry merged;
+      auto start = std::chrono::steady_clock::now();
+      mergeGeometry(merged, sources, parallel);
+      times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+      prims = (long long) merged.numPrimitives();
+    }
+    report(parallel ? "merge_parallel" : "merge", config, times, prims);
+  }
+
+  Matrix4 xform = Matrix4::identity();
+  xform.m[0][0] = xform.m[1][1] = xform.m[2][2] = 2.0;
+  xform.m[3][1] = 1.0;
+  bench("transform", config, sources, [&](Geometry& merged, const MergePlan& plan) {
+    for (const SourceRanges& ranges : plan.ranges)
+      transformRanges(merged, ranges, xform, true);
+    return (long long) merged.numpoints;
+  });
+  bench("tag_paths", config, sources, [&](Geometry& merged, const MergePlan& plan) {
+    for (size_t i = 0; i < plan.ranges.size(); i++)
+      tagStrings(merged, PRIMITIVE, "path", plan.ranges[i].prims, "/obj/source" + std::to_string(i));
+    return (long long) merged.numPrimitives();
+  });
+  bench("remap_materials", config, sources, [&](Geometry& merged, const MergePlan& plan) {
+    StringAttribute& mats = *merged.findString(PRIMITIVE, "shop_materialpath");
+    for (const SourceRanges& ranges : plan.ranges)
+      remapStrings(mats, ranges.prims, [](const std::string& value) { return "/mat/" + value; });
+    return (long long) merged.numPrimitives();
+  });
+  return 0;
+}
@@ -4,11 +4,36 @@
 
 #include "gtest/gtest.h"
 #include "../src/ams_utils.h"
+#include "../src/ams_mergefiles.h"
+#include "../src/sop_objectmerge.h"
+#include <GEO/GEO_PrimPoly.h>
+#include <GA/GA_Handle.h>
+#include <GA/GA_Iterator.h>
+#include <MOT/MOT_Director.h>
+#include <OP/OP_Director.h>
+#include <OP/OP_OperatorTable.h>
+#include <PI/PI_ResourceManager.h>
+#include <SOP/SOP_Node.h>
 
 using namespace std;
 
 #define TEST_SUITE_NAME test_hams
 
+void newSopOperator(OP_OperatorTable* table);
+
+
+// Node tests share one standalone director, which is created by the first of them.
+static OP_Network* objNetwork() {
+  static bool initialized = false;
+  if (!initialized) {
+    OPsetDirector(new MOT_Director("test_hams"));
+    PIcreateResourceManager();
+    newSopOperator(OP_Network::getOperatorTable(SOP_TABLE_NAME));
+    initialized = true;
+  }
+  return (OP_Network*) OPgetDirector()->findNode("/obj");
+}
+
 
 TEST(TEST_SUITE_NAME, Initialization) {
   // TODO
@@ -22,6 +47,157 @@ TEST(TEST_SUITE_NAME, MemberInitialization) {
   // TODO
 }
 
+TEST(TEST_SUITE_NAME, CompiledReplaceLiteral) {
+  ams::CompiledReplace replace("null", "parent");
+  EXPECT_EQ(replace("/obj/node/null/geo"), "/obj/node/parent/geo");
+  EXPECT_EQ(replace("/obj/node/null/geo/null"), "/obj/node/parent/geo/parent");
+  EXPECT_EQ(replace("/obj/node/geo"), "/obj/node/geo");
+}
+
+TEST(TEST_SUITE_NAME, CompiledReplaceBackreferences) {
+  ams::CompiledReplace replace("/obj/(\\w+)", "/world/~1");
+  EXPECT_EQ(replace("/obj/a/geo/obj/b/geo"), "/world/a/geo/world/b/geo");
+  ams::CompiledReplace swap("(/obj/node)(/null)(/geo)", "~2~3~1");
+  EXPECT_EQ(swap("/obj/node/null/geo"), "/null/geo/obj/node");
+}
+
+TEST(TEST_SUITE_NAME, CompiledReplaceInvalidGroups) {
+  // groups which don't exist or don't participate are kept as written.
+  ams::CompiledReplace missing("(/obj/node)/null(/geo)", "~3~1");
+  EXPECT_EQ(missing("/obj/node/null/geo"), "~3/obj/node");
+  ams::CompiledReplace optional("(x)?b", "[~1]");
+  EXPECT_EQ(optional("abc"), "a[~1]c");
+}
+
+TEST(TEST_SUITE_NAME, CompiledReplaceEmptyPattern) {
+  ams::CompiledReplace replace("", "x");
+  EXPECT_EQ(replace("/obj/node"), "/obj/node");
+  EXPECT_EQ(ams::re_replace("/obj/node", "", "x"), "/obj/node");
+}
+
+TEST(TEST_SUITE_NAME, LRUCacheEvictsLeastRecentlyUsed) {
+  ams::LRUCache<int, std::string> cache(3);
+  cache.insert(1, "a", 1);
+  cache.insert(2, "b", 1);
+  cache.insert(3, "c", 1);
+  // finding 1 makes 2 the least recently used.
+  ASSERT_NE(cache.find(1), nullptr);
+  cache.insert(4, "d", 1);
+  EXPECT_EQ(cache.find(2), nullptr);
+  EXPECT_EQ(*cache.find(1), "a");
+  EXPECT_EQ(*cache.find(4), "d");
+  EXPECT_EQ(cache.size(), 3u);
+}
+
+TEST(TEST_SUITE_NAME, LRUCacheBudget) {
+  ams::LRUCache<int, std::string> cache(10);
+  cache.insert(1, "a", 4);
+  cache.insert(2, "b", 4);
+  EXPECT_EQ(cache.usage(), 8u);
+  // values larger than the budget are never cached.
+  cache.insert(3, "c", 11);
+  EXPECT_EQ(cache.find(3), nullptr);
+  // replacing a value replaces its size.
+  cache.insert(2, "b", 6);
+  EXPECT_EQ(cache.usage(), 10u);
+  cache.setBudget(6);
+  EXPECT_EQ(cache.find(1), nullptr);
+  EXPECT_EQ(*cache.find(2), "b");
+  cache.clear();
+  EXPECT_EQ(cache.usage(), 0u);
+}
+
+TEST(TEST_SUITE_NAME, MergeArgsStep) {
+  // a file name starting with a digit follows the frame range as an input, not as a step.
+  const char* args[] = {"hams_merge", "-f", "1", "10", "2rocks.bgeo", "-o", "out.bgeo"};
+  ams::MergeConfig config;
+  ASSERT_TRUE(ams::parseArgs(7, args, config));
+  EXPECT_EQ(config.step, 1);
+  ASSERT_EQ(config.inputs.size(), 1u);
+  EXPECT_EQ(config.inputs[0].file, "2rocks.bgeo");
+  const char* stepargs[] = {"hams_merge", "-f", "1", "10", "--step", "3", "a.bgeo", "-o", "out.bgeo"};
+  ams::MergeConfig stepconfig;
+  ASSERT_TRUE(ams::parseArgs(9, stepargs, stepconfig));
+  EXPECT_EQ(stepconfig.step, 3);
+  const char* badargs[] = {"hams_merge", "-f", "1", "10x", "a.bgeo", "-o", "out.bgeo"};
+  ams::MergeConfig badconfig;
+  EXPECT_FALSE(ams::parseArgs(7, badargs, badconfig));
+}
+
+TEST(TEST_SUITE_NAME, MergeDetailsTagsExpandedFiles) {
+  ams::MergeConfig config;
+  const char* args[] = {"hams_merge", "-o", "out.bgeo", "rock.$F4.bgeo", "tree.$F4.bgeo", "--path", "/set/tree",
+                        "--xform", "1,0,0,0,0,1,0,0,0,0,1,0,5,0,0,1"};
+  ASSERT_TRUE(ams::parseArgs(9, args, config));
+  std::vector<GU_ConstDetailHandle> details;
+  for (int i = 0; i < 2; i++) {
+    GU_DetailHandle handle;
+    handle.allocateAndSet(new GU_Detail());
+    GEO_PrimPoly::build(handle.gdpNC(), 3, false, true);
+    details.push_back(handle);
+  }
+  GU_Detail merged;
+  std::vector<std::string> warnings;
+  ASSERT_EQ(ams::mergeDetails(merged, config, details, 12, warnings), "");
+  EXPECT_TRUE(warnings.empty());
+  ASSERT_EQ(merged.getNumPrimitives(), 2);
+  GA_ROHandleS path(merged.findPrimitiveAttribute("path"));
+  GA_ROHandleS nodepath(merged.findPrimitiveAttribute("nodepath"));
+  ASSERT_TRUE(path.isValid() && nodepath.isValid());
+  EXPECT_STREQ(path.get(merged.primitiveOffset(0)), "rock");
+  EXPECT_STREQ(path.get(merged.primitiveOffset(1)), "/set/tree");
+  EXPECT_STREQ(nodepath.get(merged.primitiveOffset(0)), "rock.0012.bgeo");
+  EXPECT_STREQ(nodepath.get(merged.primitiveOffset(1)), "tree.0012.bgeo");
+  // only the second input is transformed.
+  EXPECT_EQ(merged.getPos3(merged.pointOffset(0)).x(), 0.0f);
+  EXPECT_EQ(merged.getPos3(merged.pointOffset(3)).x(), 5.0f);
+
+  // an input without geometry fails the frame instead of being left out of it.
+  details[1] = GU_ConstDetailHandle();
+  GU_Detail partial;
+  std::string error = ams::mergeDetails(partial, config, details, 12, warnings);
+  EXPECT_NE(error.find("tree.0012.bgeo"), std::string::npos);
+}
+
+TEST(TEST_SUITE_NAME, IncrementalMirroredSource) {
+  OP_Network* obj = objNetwork();
+  OP_Node* xform = obj->createNode("null", "mirror_xform");
+  OP_Network* mirrored = (OP_Network*) obj->createNode("geo", "mirrored");
+  mirrored->setFloat("s", 0, 0.0f, -1.0f);
+  OP_Node* box = mirrored->createNode("box", "box");
+  box->setDisplay(true);
+  OP_Network* out = (OP_Network*) obj->createNode("geo", "mirror_merged");
+  auto* merge = (ams::SOP_ObjectMerge*) out->createNode("ams::objectmerge::1.0", "merge");
+  UT_String path("/obj/mirrored");
+  UT_String xformpath("/obj/mirror_xform");
+  merge->setNUMOBJ(1);
+  merge->setSOPPATH(path, CH_STRING_LITERAL, 1, 0.0f);
+  merge->setString(xformpath, CH_STRING_LITERAL, "xformpath", 0, 0.0f);
+  merge->setINCREMENTAL(1);
+
+  OP_Context context(0.0f);
+  auto normals = [&]() {
+    std::vector<UT_Vector3> result;
+    const GU_Detail* geo = merge->getCookedGeo(context);
+    if (geo) {
+      for (GA_Iterator it(geo->getPrimitiveRange()); !it.atEnd(); ++it)
+        result.push_back(geo->getGEOPrimitive(*it)->computeNormal());
+    }
+    return result;
+  };
+  std::vector<UT_Vector3> first = normals();
+  ASSERT_EQ(first.size(), 6u);
+  // Moving the transform object changes nothing but the transform of the mirrored source, so every cook
+  // must keep the faces pointing the same way.
+  for (int i = 1; i <= 2; i++) {
+    xform->setFloat("t", 0, 0.0f, fpreal(i));
+    std::vector<UT_Vector3> moved = normals();
+    ASSERT_EQ(moved.size(), first.size());
+    for (size_t p = 0; p < first.size(); p++)
+      EXPECT_GT(first[p].dot(moved[p]), 0.5f) << "face " << p << " after move " << i;
+  }
+}
+
 int main(int argc, char** argv) {
   int* argc_ = new int(argc);
   ::testing::InitGoogleTest(argc_, argv);
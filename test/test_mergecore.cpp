@@ -0,0 +1,240 @@
+#include "gtest/gtest.h"
+#include "../src/ams_mergecore.h"
+#include <cmath>
+
+using namespace std;
+using namespace ams::core;
+
+#define TEST_SUITE_NAME test_mergecore
+
+
+// A grid of rows x rows quads in the XZ plane, with up facing normals.
+static Geometry makeGrid(int rows, float offset = 0.0f) {
+  Geometry geo;
+  geo.numpoints = (size_t) (rows + 1) * (rows + 1);
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < rows; c++) {
+      int64_t p = r * (rows + 1) + c;
+      geo.appendPolygon({p, p + 1, p + rows + 2, p + rows + 1});
+    }
+  }
+  geo.addFloat(POINT, "P", 3, TypeInfo::POINT);
+  geo.addFloat(POINT, "N", 3, TypeInfo::NORMAL);
+  FloatAttribute& P = *geo.findFloat(POINT, "P");
+  FloatAttribute& N = *geo.findFloat(POINT, "N");
+  for (size_t i = 0; i < geo.numpoints; i++) {
+    P.components[0][i] = (float) (i % (rows + 1)) + offset;
+    P.components[2][i] = (float) (i / (rows + 1));
+    N.components[1][i] = 1.0f;
+  }
+  return geo;
+}
+
+
+TEST(TEST_SUITE_NAME, PlanAllocatesRangesInOrder) {
+  Geometry a = makeGrid(2), b = makeGrid(3);
+  MergePlan plan = planMerge({&a, &b});
+  ASSERT_EQ(plan.ranges.size(), 2u);
+  EXPECT_EQ(plan.ranges[0].points.start, 0u);
+  EXPECT_EQ(plan.ranges[1].points.start, 9u);
+  EXPECT_EQ(plan.ranges[1].vertices.start, 16u);
+  EXPECT_EQ(plan.ranges[1].prims.start, 4u);
+  EXPECT_EQ(plan.numpoints, 25u);
+  EXPECT_EQ(plan.numvertices, 52u);
+  EXPECT_EQ(plan.numprims, 13u);
+}
+
+
+TEST(TEST_SUITE_NAME, MergeCopiesTopologyAndAttributes) {
+  Geometry a = makeGrid(1), b = makeGrid(1, 10.0f);
+  b.addFloat(PRIMITIVE, "id", 1).components[0] = {7.0f};
+  Geometry merged;
+  mergeGeometry(merged, {&a, &b}, false);
+  EXPECT_EQ(merged.numPrimitives(), 2u);
+  EXPECT_EQ(merged.primstarts, (vector<int64_t>{0, 4, 8}));
+  EXPECT_EQ(merged.vertexpoints[4], 4);
+  EXPECT_EQ(merged.findFloat(POINT, "P")->components[0][4], 10.0f);
+  // Attributes missing from a source are zero over its range.
+  const FloatAttribute* id = merged.findFloat(PRIMITIVE, "id");
+  ASSERT_NE(id, nullptr);
+  EXPECT_EQ(id->components[0], (vector<float>{0.0f, 7.0f}));
+}
+
+
+TEST(TEST_SUITE_NAME, MissingAttributesTakeTheirDefaults) {
+  Geometry a = makeGrid(1), b = makeGrid(1);
+  FloatAttribute& Cd = b.addFloat(POINT, "Cd", 3);
+  Cd.defaults = {1.0f, 1.0f, 1.0f};
+  Cd.components[0].assign(b.numpoints, 0.5f);
+  Geometry merged;
+  mergeGeometry(merged, {&a, &b}, false);
+  const FloatAttribute* attr = merged.findFloat(POINT, "Cd");
+  ASSERT_NE(attr, nullptr);
+  EXPECT_EQ(attr->components[0][0], 1.0f);
+  EXPECT_EQ(attr->components[2][3], 1.0f);
+  EXPECT_EQ(attr->components[0][4], 0.5f);
+  EXPECT_EQ(attr->components[1][4], 0.0f);
+}
+
+
+TEST(TEST_SUITE_NAME, MergeSharesStringTables) {
+  Geometry a = makeGrid(1), b = makeGrid(2);
+  tagStrings(a, PRIMITIVE, "shop_materialpath", {0, 1}, "/mat/a");
+  StringAttribute& mats = b.addString(PRIMITIVE, "shop_materialpath");
+  mats.indices = {mats.add("/mat/b"), mats.add("/mat/a"), StringAttribute::NONE, mats.add("/mat/b")};
+  Geometry merged;
+  mergeGeometry(merged, {&a, &b}, false);
+  const StringAttribute* attr = merged.findString(PRIMITIVE, "shop_materialpath");
+  ASSERT_NE(attr, nullptr);
+  EXPECT_EQ(attr->table.size(), 2u);
+  EXPECT_EQ(attr->get(0), "/mat/a");
+  EXPECT_EQ(attr->get(1), "/mat/b");
+  EXPECT_EQ(attr->get(2), "/mat/a");
+  EXPECT_EQ(attr->get(3), "");
+  EXPECT_EQ(attr->indices[0], attr->indices[2]);
+}
+
+
+TEST(TEST_SUITE_NAME, ParallelMergeMatchesSerial) {
+  vector<Geometry> sources;
+  for (int i = 0; i < 16; i++) {
+    sources.push_back(makeGrid(4 + i % 3, (float) i));
+    tagStrings(sources.back(), PRIMITIVE, "path", {0, sources.back().numPrimitives()}, "/obj/" + to_string(i % 5));
+  }
+  vector<const Geometry*> pointers;
+  for (const Geometry& source : sources)
+    pointers.push_back(&source);
+  Geometry serial, parallel;
+  mergeGeometry(serial, pointers, false);
+  mergeGeometry(parallel, pointers, true);
+  EXPECT_EQ(serial.vertexpoints, parallel.vertexpoints);
+  EXPECT_EQ(serial.primstarts, parallel.primstarts);
+  EXPECT_EQ(serial.findFloat(POINT, "P")->components, parallel.findFloat(POINT, "P")->components);
+  EXPECT_EQ(serial.findString(PRIMITIVE, "path")->indices, parallel.findString(PRIMITIVE, "path")->indices);
+}
+
+
+TEST(TEST_SUITE_NAME, TransformMovesPointsAndKeepsNormalLengths) {
+  Geometry a = makeGrid(1), b = makeGrid(1);
+  Geometry merged;
+  MergePlan plan = mergeGeometry(merged, {&a, &b}, false);
+  // Scale Y by 2 and translate X by 5, on the second source only.
+  Matrix4 xform = Matrix4::identity();
+  xform.m[1][1] = 2.0;
+  xform.m[3][0] = 5.0;
+  transformRanges(merged, plan.ranges[1], xform, false);
+  const FloatAttribute* P = merged.findFloat(POINT, "P");
+  const FloatAttribute* N = merged.findFloat(POINT, "N");
+  EXPECT_EQ(P->components[0][0], 0.0f);
+  EXPECT_EQ(P->components[0][4], 5.0f);
+  EXPECT_EQ(P->components[0][5], 6.0f);
+  EXPECT_FLOAT_EQ(N->components[1][4], 1.0f);
+  // Shears tilt normals through the inverse transpose, but never change their length.
+  xform = Matrix4::identity();
+  xform.m[0][1] = 1.0;
+  transformRanges(merged, plan.ranges[1], xform, false);
+  float x = N->components[0][4], y = N->components[1][4], z = N->components[2][4];
+  EXPECT_NEAR(std::sqrt(x * x + y * y + z * z), 1.0, 1e-6);
+  EXPECT_LT(x, 0.0f);
+}
+
+
+TEST(TEST_SUITE_NAME, TransformKeepsVectorLengths) {
+  Geometry geo = makeGrid(1);
+  FloatAttribute& v = geo.addFloat(POINT, "v", 3, TypeInfo::VECTOR);
+  v.components[0].assign(geo.numpoints, 1.0f);
+  SourceRanges ranges{{0, geo.numpoints}, {0, geo.numVertices()}, {0, geo.numPrimitives()}};
+  Matrix4 xform = Matrix4::identity();
+  xform.m[0][0] = 3.0;
+  xform.m[0][1] = 3.0;
+  transformRanges(geo, ranges, xform, false);
+  const FloatAttribute* attr = geo.findFloat(POINT, "v");
+  EXPECT_FLOAT_EQ(attr->components[0][0], (float) std::sqrt(0.5));
+  EXPECT_FLOAT_EQ(attr->components[1][0], (float) std::sqrt(0.5));
+}
+
+
+TEST(TEST_SUITE_NAME, PackedTransformMatchesRanges) {
+  Geometry geo = makeGrid(2);
+  Matrix4 xform = Matrix4::identity();
+  xform.m[0][1] = 0.5;
+  xform.m[2][2] = -2.0;
+  xform.m[3][1] = 4.0;
+  vector<double> packed;
+  const FloatAttribute& P = *geo.findFloat(POINT, "P");
+  const FloatAttribute& N = *geo.findFloat(POINT, "N");
+  for (size_t i = 0; i < geo.numpoints; i++) {
+    for (int c = 0; c < 3; c++)
+      packed.push_back(N.components[c][i]);
+  }
+  vector<double> positions;
+  for (size_t i = 0; i < geo.numpoints; i++) {
+    for (int c = 0; c < 3; c++)
+      positions.push_back(P.components[c][i]);
+  }
+  transformPacked(packed.data(), geo.numpoints, VectorTransform(xform, TypeInfo::NORMAL));
+  transformPacked(positions.data(), geo.numpoints, VectorTransform(xform, TypeInfo::POINT));
+  SourceRanges ranges{{0, geo.numpoints}, {0, geo.numVertices()}, {0, geo.numPrimitives()}};
+  transformRanges(geo, ranges, xform, false);
+  for (size_t i = 0; i < geo.numpoints; i++) {
+    for (int c = 0; c < 3; c++) {
+      EXPECT_FLOAT_EQ(geo.findFloat(POINT, "N")->components[c][i], (float) packed[i * 3 + c]);
+      EXPECT_FLOAT_EQ(geo.findFloat(POINT, "P")->components[c][i], (float) positions[i * 3 + c]);
+    }
+  }
+}
+
+
+TEST(TEST_SUITE_NAME, NegativeDeterminantReversesPolygons) {
+  Geometry geo = makeGrid(1);
+  SourceRanges ranges{{0, geo.numpoints}, {0, geo.numVertices()}, {0, geo.numPrimitives()}};
+  Matrix4 mirror = Matrix4::identity();
+  mirror.m[0][0] = -1.0;
+  transformRanges(geo, ranges, mirror, false);
+  EXPECT_EQ(geo.vertexpoints, (vector<int64_t>{0, 2, 3, 1}));
+  EXPECT_EQ(geo.findFloat(POINT, "P")->components[0][1], -1.0f);
+  EXPECT_FLOAT_EQ(geo.findFloat(POINT, "N")->components[1][0], 1.0f);
+}
+
+
+TEST(TEST_SUITE_NAME, RemapResolvesEachStringOnce) {
+  Geometry geo = makeGrid(4);
+  StringAttribute& mats = geo.addString(PRIMITIVE, "shop_materialpath");
+  for (size_t i = 0; i < geo.numPrimitives(); i++)
+    mats.indices[i] = i % 3 == 0 ? StringAttribute::NONE : mats.add("mat" + to_string(i % 3));
+  int calls = 0;
+  remapStrings(mats, {0, geo.numPrimitives()}, [&](const string& value) {
+    calls++;
+    return value.empty() ? string("/obj/default") : "/mat/" + value;
+  });
+  EXPECT_EQ(calls, 3);
+  EXPECT_EQ(mats.get(0), "/obj/default");
+  EXPECT_EQ(mats.get(1), "/mat/mat1");
+  EXPECT_EQ(mats.get(5), "/mat/mat2");
+}
+
+
+TEST(TEST_SUITE_NAME, RemapOnlyTouchesItsRange) {
+  Geometry geo = makeGrid(2);
+  tagStrings(geo, PRIMITIVE, "path", {0, 2}, "/a");
+  tagStrings(geo, PRIMITIVE, "path", {2, 2}, "/b");
+  StringAttribute& path = *geo.findString(PRIMITIVE, "path");
+  remapStrings(path, {2, 2}, [](const string& value) { return value + "/c"; });
+  EXPECT_EQ(path.get(0), "/a");
+  EXPECT_EQ(path.get(3), "/b/c");
+}
+
+
+TEST(TEST_SUITE_NAME, IndexRemapResolvesEachIndexOnce) {
+  int calls = 0;
+  auto remap = makeIndexRemap([&](int64_t index) -> int64_t {
+    calls++;
+    return index < 0 ? 100 : index * 2;
+  });
+  EXPECT_EQ(remap(3), 6);
+  EXPECT_EQ(remap(-1), 100);
+  EXPECT_EQ(remap(3), 6);
+  EXPECT_EQ(remap(-5), 100);
+  EXPECT_EQ(remap(0), 0);
+  EXPECT_EQ(calls, 3);
+}